@@ -0,0 +1,222 @@
+/**
+ * @file aesd-circular-buffer-seqlock.c
+ * @brief Thread-safe userspace circular buffer for a single producer and concurrent readers
+ *
+ * The producer brackets every change to the buffer with increments of the sequence counter, so
+ * the counter is odd while a change is in progress. Readers sample the counter, copy what they
+ * need, and retry if the counter was odd or changed in the meantime. As in the kernel seqlock,
+ * the data itself is accessed with plain loads and stores ordered by fences; a reader may see a
+ * torn value mid-change but always discards it. Everything a reader dereferences (the entry
+ * slots and the arena) stays allocated for the life of the buffer, and every index a reader
+ * computes is masked, so torn values can't send a reader out of bounds.
+ */
+
+#ifndef __KERNEL__
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd-circular-buffer-seqlock.h"
+
+/**
+ * @brief   Start a change to the buffer, making the sequence counter odd.
+ */
+static void write_begin(struct aesd_seqlock_buffer *sb)
+{
+    unsigned seq = atomic_load_explicit(&sb->seq, memory_order_relaxed);
+    atomic_store_explicit(&sb->seq, seq + 1, memory_order_relaxed);
+    // Order the odd counter before any stores to the buffer
+    atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * @brief   Finish a change to the buffer, making the sequence counter even again.
+ */
+static void write_end(struct aesd_seqlock_buffer *sb)
+{
+    unsigned seq = atomic_load_explicit(&sb->seq, memory_order_relaxed);
+    atomic_store_explicit(&sb->seq, seq + 1, memory_order_release);
+}
+
+/**
+ * @brief   Wait until no change is in progress and return the sequence counter.
+ */
+static unsigned read_begin(struct aesd_seqlock_buffer *sb)
+{
+    unsigned seq;
+    while ((seq = atomic_load_explicit(&sb->seq, memory_order_acquire)) & 1) {
+        sched_yield();
+    }
+    return seq;
+}
+
+/**
+ * @return  true if the buffer changed since read_begin() returned @param seq and the data read
+ *          since must be discarded.
+ */
+static bool read_retry(struct aesd_seqlock_buffer *sb, unsigned seq)
+{
+    // Order the reads of the buffer before re-reading the counter
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&sb->seq, memory_order_relaxed) != seq;
+}
+
+/**
+ * @brief   Copy @param count bytes starting at stream offset @param pos out of the arena,
+ *          splitting the copy at the wrap point.
+ */
+static void arena_copy_out(struct aesd_seqlock_buffer *sb, char *dst, size_t pos, size_t count)
+{
+    size_t offs = pos & sb->arena_mask;
+    size_t first = sb->arena_mask + 1 - offs;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(dst, sb->arena + offs, first);
+    memcpy(dst + first, sb->arena, count - first);
+}
+
+/**
+ * @brief   Copy @param count bytes into the arena starting at stream offset @param pos,
+ *          splitting the copy at the wrap point.
+ */
+static void arena_copy_in(struct aesd_seqlock_buffer *sb, size_t pos, const char *src, size_t count)
+{
+    size_t offs = pos & sb->arena_mask;
+    size_t first = sb->arena_mask + 1 - offs;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(sb->arena + offs, src, first);
+    memcpy(sb->arena, src + first, count - first);
+}
+
+int aesd_seqlock_buffer_init(struct aesd_seqlock_buffer *sb, size_t depth, size_t arena_size)
+{
+    memset(sb, 0, sizeof(*sb));
+    if (depth == 0 || depth > AESDCHAR_MAX_DEPTH) {
+        return -1;
+    }
+
+    size_t arena_capacity = 1;
+    while (arena_capacity < arena_size) {
+        arena_capacity <<= 1;
+    }
+    size_t capacity = aesd_circular_buffer_capacity_for_depth(depth);
+    struct aesd_buffer_entry *storage = malloc(capacity * sizeof(*storage));
+    sb->arena = malloc(arena_capacity);
+    if (storage == NULL || sb->arena == NULL) {
+        free(storage);
+        free(sb->arena);
+        sb->arena = NULL;
+        return -1;
+    }
+
+    aesd_circular_buffer_init(&sb->buffer);
+    aesd_circular_buffer_resize(&sb->buffer, storage, capacity, depth);
+    sb->arena_mask = arena_capacity - 1;
+    atomic_init(&sb->seq, 0);
+    return 0;
+}
+
+void aesd_seqlock_buffer_destroy(struct aesd_seqlock_buffer *sb)
+{
+    if (sb->buffer.entry != sb->buffer.inline_entry) {
+        free(sb->buffer.entry);
+    }
+    free(sb->arena);
+    sb->arena = NULL;
+}
+
+bool aesd_seqlock_buffer_append(struct aesd_seqlock_buffer *sb, const char *data, size_t size)
+{
+    struct aesd_circular_buffer *buffer = &sb->buffer;
+    size_t arena_capacity = sb->arena_mask + 1;
+    if (size > arena_capacity) {
+        return false;
+    }
+
+    // Drop entries to make room for the new one, both in the ring and in the arena. Readers
+    // copying the dropped data will see the counter change and retry.
+    struct aesd_buffer_entry entry = {.buffptr = NULL, .size = size, .stamp = 0};
+    struct aesd_buffer_entry evicted;
+    write_begin(sb);
+    while (aesd_circular_buffer_evict_entry(buffer, &entry, 0, &evicted)) {
+    }
+    while (buffer->total_size + size > arena_capacity) {
+        aesd_circular_buffer_remove_entry(buffer, &evicted);
+    }
+    write_end(sb);
+
+    // The space past the committed data isn't visible to readers, so fill it outside of a change
+    size_t pos = buffer->base_offs + buffer->total_size;
+    arena_copy_in(sb, pos, data, size);
+    entry.buffptr = sb->arena + (pos & sb->arena_mask);
+
+    write_begin(sb);
+    aesd_circular_buffer_add_entry(buffer, &entry);
+    write_end(sb);
+    return true;
+}
+
+size_t aesd_seqlock_buffer_read(
+    struct aesd_seqlock_buffer *sb, size_t char_offset, char *dst, size_t count
+) {
+    size_t result;
+    unsigned seq;
+    do {
+        seq = read_begin(sb);
+        size_t total_size = sb->buffer.total_size;
+        result = 0;
+        if (char_offset < total_size) {
+            result = total_size - char_offset;
+            if (result > count) {
+                result = count;
+            }
+            if (result > sb->arena_mask + 1) {
+                // Only possible with a torn total_size, which the retry discards
+                result = sb->arena_mask + 1;
+            }
+            arena_copy_out(sb, dst, sb->buffer.base_offs + char_offset, result);
+        }
+    } while (read_retry(sb, seq));
+    return result;
+}
+
+bool aesd_seqlock_buffer_read_entry(
+    struct aesd_seqlock_buffer *sb, size_t i, char *dst, size_t count, size_t *size_rtn
+) {
+    bool result;
+    unsigned seq;
+    do {
+        seq = read_begin(sb);
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry_at_out_index(
+            &sb->buffer, i
+        );
+        result = entry != NULL;
+        if (result) {
+            size_t size = entry->size;
+            size_t copy_count = size < count ? size : count;
+            if (copy_count > sb->arena_mask + 1) {
+                copy_count = sb->arena_mask + 1;
+            }
+            arena_copy_out(sb, dst, entry->stream_offs, copy_count);
+            *size_rtn = size;
+        }
+    } while (read_retry(sb, seq));
+    return result;
+}
+
+size_t aesd_seqlock_buffer_size(struct aesd_seqlock_buffer *sb)
+{
+    size_t result;
+    unsigned seq;
+    do {
+        seq = read_begin(sb);
+        result = sb->buffer.total_size;
+    } while (read_retry(sb, seq));
+    return result;
+}
+
+#endif /* __KERNEL__ */
@@ -0,0 +1,96 @@
+/**
+ * @file aesd-circular-buffer-seqlock.h
+ * @brief Thread-safe userspace circular buffer for a single producer and concurrent readers
+ *
+ * Wraps struct aesd_circular_buffer with a sequence counter. One producer thread appends entries
+ * without ever waiting on readers, and any number of reader threads copy out consistent
+ * snapshots, retrying if the producer changed the buffer while they were copying.
+ *
+ * Entry data is copied into a byte ring owned by the buffer, laid out like the aesdchar arena:
+ * byte n of the history stream lives at arena[n & arena_mask]. Evicting an entry never frees
+ * memory, so a reader racing with the producer can read stale bytes but never freed memory.
+ */
+
+#ifndef AESD_CIRCULAR_BUFFER_SEQLOCK_H
+#define AESD_CIRCULAR_BUFFER_SEQLOCK_H
+
+#ifndef __KERNEL__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "aesd-circular-buffer.h"
+
+struct aesd_seqlock_buffer
+{
+    /**
+     * Entry descriptors pointing into arena. Only modified by the producer.
+     */
+    struct aesd_circular_buffer buffer;
+    /**
+     * Byte ring holding the data of every entry
+     */
+    char *arena;
+    /**
+     * Number of bytes in arena minus one, arena size is a power of two
+     */
+    size_t arena_mask;
+    /**
+     * Sequence counter, odd while the producer is modifying the buffer
+     */
+    atomic_uint seq;
+};
+
+/**
+ * @brief   Allocate storage for a buffer retaining up to @param depth entries and
+ *          @param arena_size bytes (rounded up to a power of two).
+ *
+ * @return  0 on success, -1 if allocation failed or @param depth is out of range.
+ */
+int aesd_seqlock_buffer_init(struct aesd_seqlock_buffer *sb, size_t depth, size_t arena_size);
+
+/**
+ * @brief   Free storage allocated by aesd_seqlock_buffer_init(). No other thread may be using
+ *          the buffer.
+ */
+void aesd_seqlock_buffer_destroy(struct aesd_seqlock_buffer *sb);
+
+/**
+ * @brief   Append a copy of @param data as a new entry, evicting the oldest entries as needed.
+ *          Must only be called from the single producer thread.
+ *
+ * @return  true on success, false if @param size exceeds the arena size.
+ */
+bool aesd_seqlock_buffer_append(struct aesd_seqlock_buffer *sb, const char *data, size_t size);
+
+/**
+ * @brief   Copy up to @param count bytes starting at @param char_offset of the concatenated
+ *          entries into @param dst, as one consistent snapshot. Safe to call from any thread.
+ *
+ * @return  The number of bytes copied, 0 if @param char_offset is past the end of data.
+ */
+size_t aesd_seqlock_buffer_read(
+    struct aesd_seqlock_buffer *sb, size_t char_offset, char *dst, size_t count
+);
+
+/**
+ * @brief   Copy the entry at zero referenced index @param i from the oldest entry into
+ *          @param dst, truncated to @param count bytes. Safe to call from any thread.
+ *
+ * @param   size_rtn Location to store the full size of the entry.
+ *
+ * @return  true if the entry exists, false otherwise.
+ */
+bool aesd_seqlock_buffer_read_entry(
+    struct aesd_seqlock_buffer *sb, size_t i, char *dst, size_t count, size_t *size_rtn
+);
+
+/**
+ * @return  The total number of bytes stored in @param sb. Safe to call from any thread.
+ */
+size_t aesd_seqlock_buffer_size(struct aesd_seqlock_buffer *sb);
+
+#endif /* __KERNEL__ */
+
+#endif /* AESD_CIRCULAR_BUFFER_SEQLOCK_H */
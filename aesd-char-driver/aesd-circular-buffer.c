@@ -31,36 +31,214 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
     struct aesd_circular_buffer *buffer, size_t char_offset, size_t *entry_offset_byte_rtn
 ) {
-    // Running sum of the size of entries
-    size_t search_offset = 0;
-
-    // Start at the output offset and search until we wrap back around
-    uint8_t i = buffer->out_offs;
-    do {
-        // Increase the search sum
-        search_offset += buffer->entry[i].size;
-
-        // Check if the sum is large enough to find the result
-        if (search_offset > char_offset) {
-            // Subtract off the most recent entry size to find the relative offset into this entry
-            search_offset -= buffer->entry[i].size;
-            *entry_offset_byte_rtn = char_offset - search_offset;
-
-            // Return a pointer to the entry
-            return &buffer->entry[i];
+    return aesd_buffer_index_find_entry_offset_for_fpos(
+        &buffer->index, char_offset, entry_offset_byte_rtn
+    );
+}
+
+/**
+ * @brief   Like aesd_circular_buffer_find_entry_offset_for_fpos(), looking up the entries
+ *          described by @param buffer, which may be a copy of the index of a buffer.
+ */
+struct aesd_buffer_entry *aesd_buffer_index_find_entry_offset_for_fpos(
+    const struct aesd_buffer_index *buffer, size_t char_offset, size_t *entry_offset_byte_rtn
+) {
+    // Offsets past the end of data can be rejected without searching
+    if (char_offset >= buffer->total_size) {
+        return NULL;
+    }
+
+    // Binary search for the last entry starting at or before char_offset. The cached stream
+    // offsets increase monotonically from out_offs, so this is the entry containing the byte.
+    // Zero-sized entries share a start offset with their successor and are skipped naturally.
+    size_t lo = 0;
+    size_t hi = aesd_buffer_index_count(buffer);
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        struct aesd_buffer_entry *entry = aesd_buffer_index_get_entry_at_out_index(buffer, mid);
+        if (aesd_buffer_index_entry_fpos(buffer, entry) <= char_offset) {
+            lo = mid;
+        } else {
+            hi = mid;
         }
+    }
 
-        // Modular increment to next buffer entry
-        i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    } while (i != buffer->out_offs);
-    return NULL;
+    struct aesd_buffer_entry *entry = aesd_buffer_index_get_entry_at_out_index(buffer, lo);
+    *entry_offset_byte_rtn = char_offset - aesd_buffer_index_entry_fpos(buffer, entry);
+    return entry;
+}
+
+/**
+ * @brief   Describes up to @param count bytes of @param buffer starting at @param char_offset as
+ *          an array of I/O vectors, one per entry touched. Any necessary locking must be
+ *          performed by caller, and the vectors are only valid while the lock is held.
+ *
+ * The range may span any number of entries and the wrap point of the entry ring. Empty entries
+ * are skipped.
+ *
+ * @param   char_offset The zero referenced character index of the first byte to describe if all
+ *              buffer strings were concatenated end to end.
+ * @param   iov Array of @param iov_len vectors to fill. If it runs out of room, the range is
+ *              truncated at the end of the last vector filled.
+ * @param   bytes_rtn Location to store the total number of bytes described by the vectors.
+ *
+ * @return  The number of vectors filled, 0 if @param char_offset is past the end of data.
+ */
+size_t aesd_circular_buffer_fill_iovec(
+    struct aesd_circular_buffer *buffer,
+    size_t char_offset,
+    size_t count,
+    struct aesd_iovec *iov,
+    size_t iov_len,
+    size_t *bytes_rtn
+) {
+    return aesd_circular_buffer_fill_iovec_cursor(
+        buffer, NULL, char_offset, count, iov, iov_len, bytes_rtn
+    );
+}
+
+/**
+ * @return  The entry of @param buffer holding @param char_offset according to @param cursor,
+ *          storing its index from out_offs in @param index_rtn, or NULL if the cursor doesn't
+ *          describe that position.
+ */
+static struct aesd_buffer_entry *cursor_entry(
+    const struct aesd_buffer_index *buffer,
+    const struct aesd_buffer_cursor *cursor,
+    size_t char_offset,
+    size_t *index_rtn
+) {
+    if (cursor->slot > buffer->mask) {
+        return NULL;
+    }
+    struct aesd_buffer_entry *entry = &buffer->entry[cursor->slot];
+    size_t index = (cursor->slot - buffer->out_offs) & buffer->mask;
+    if (
+        index >= aesd_buffer_index_count(buffer)
+        || entry->stream_offs != cursor->stream_offs
+        || cursor->offset >= entry->size
+        || buffer->base_offs + char_offset != cursor->stream_offs + cursor->offset
+    ) {
+        return NULL;
+    }
+    *index_rtn = index;
+    return entry;
+}
+
+/**
+ * @brief   Like aesd_circular_buffer_fill_iovec(), starting from @param cursor instead of
+ *          searching for @param char_offset if it describes that position, and leaving it at the
+ *          end of the range described.
+ *
+ * A reader that keeps a cursor and continues where its last range ended finds its first entry
+ * in constant time, however many entries the buffer holds. A range ending at the end of data
+ * leaves the cursor on the slot the next entry goes to, so it's found the same way once added.
+ *
+ * @param   cursor The cursor to start from and update, or NULL to search.
+ */
+size_t aesd_circular_buffer_fill_iovec_cursor(
+    struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_cursor *cursor,
+    size_t char_offset,
+    size_t count,
+    struct aesd_iovec *iov,
+    size_t iov_len,
+    size_t *bytes_rtn
+) {
+    return aesd_buffer_index_fill_iovec_cursor(
+        &buffer->index, cursor, char_offset, count, iov, iov_len, bytes_rtn
+    );
+}
+
+/**
+ * @brief   Like aesd_circular_buffer_fill_iovec_cursor(), describing the entries described by
+ *          @param buffer, which may be a copy of the index of a buffer.
+ */
+size_t aesd_buffer_index_fill_iovec_cursor(
+    const struct aesd_buffer_index *buffer,
+    struct aesd_buffer_cursor *cursor,
+    size_t char_offset,
+    size_t count,
+    struct aesd_iovec *iov,
+    size_t iov_len,
+    size_t *bytes_rtn
+) {
+    size_t result = 0;
+    size_t bytes = 0;
+    size_t entry_offset = 0;
+    // Index of entry from out_offs
+    size_t i = 0;
+    struct aesd_buffer_entry *entry = NULL;
+    if (cursor != NULL) {
+        entry = cursor_entry(buffer, cursor, char_offset, &i);
+        entry_offset = cursor->offset;
+    }
+    if (entry == NULL) {
+        entry = aesd_buffer_index_find_entry_offset_for_fpos(buffer, char_offset, &entry_offset);
+        if (entry != NULL) {
+            i = ((size_t)(entry - buffer->entry) - buffer->out_offs) & buffer->mask;
+        }
+    }
+    // Walk forward from the entry containing char_offset, remembering where the range ends
+    struct aesd_buffer_entry *last = NULL;
+    size_t last_end = 0;
+    while (entry != NULL && result < iov_len && bytes < count) {
+        size_t len = entry->size - entry_offset;
+        if (len > count - bytes) {
+            len = count - bytes;
+        }
+        if (len > 0) {
+            iov[result].iov_base = (char *)entry->buffptr + entry_offset;
+            iov[result].iov_len = len;
+            result++;
+            bytes += len;
+            last = entry;
+            last_end = entry_offset + len;
+        }
+        entry_offset = 0;
+        entry = aesd_buffer_index_get_entry_at_out_index(buffer, ++i);
+    }
+    if (cursor != NULL && last != NULL) {
+        size_t slot = (size_t)(last - buffer->entry);
+        if (last_end < last->size) {
+            cursor->slot = slot;
+            cursor->offset = last_end;
+            cursor->stream_offs = last->stream_offs;
+        } else {
+            // The range ended with its last entry, continue at the start of the next one
+            cursor->slot = (slot + 1) & buffer->mask;
+            cursor->offset = 0;
+            cursor->stream_offs = last->stream_offs + last->size;
+        }
+    }
+    *bytes_rtn = bytes;
+    return result;
+}
+
+/**
+ * @brief   Drops the oldest entry of @param buffer, clearing its slot and updating the running
+ *          totals. The buffer must not be empty.
+ *
+ * @return  Pointer to data from the dropped entry to be freed by the user.
+ */
+static const char *drop_oldest_entry(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *oldest = &buffer->entry[buffer->out_offs];
+    const char *result = oldest->buffptr;
+    buffer->base_offs += oldest->size;
+    buffer->total_size -= oldest->size;
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+    buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+    buffer->full = false;
+    return result;
 }
 
 /**
 * @brief    Adds entry `entry` to `buffer` in the location specified in `buffer->in_offs`.
 *
-* - If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to
-*   the new start location. The oldest entry will be copied to `out_entry` before overwriting.
+* - If the buffer was already full, drops the oldest entry and advances buffer->out_offs to
+*   the new start location.
 * - Any necessary locking must be handled by the caller.
 * - Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime
 *   managed by the caller.
@@ -73,33 +251,249 @@ const char *aesd_circular_buffer_add_entry(
 ) {
     const char *result = NULL;
     if (buffer->full) {
-        result = buffer->entry[buffer->out_offs].buffptr;
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        result = drop_oldest_entry(buffer);
     }
+    size_t count = aesd_circular_buffer_count(buffer) + 1;
     buffer->entry[buffer->in_offs] = *entry;
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    if (buffer->in_offs == buffer->out_offs) {
-        buffer->full = true;
-    }
+    buffer->entry[buffer->in_offs].stream_offs = buffer->base_offs + buffer->total_size;
+    buffer->total_size += entry->size;
+    buffer->in_offs = (buffer->in_offs + 1) & buffer->mask;
+    buffer->full = count == buffer->depth;
     return result;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Initializes the circular buffer described by @param buffer to an empty struct using the inline
+* storage and a depth of AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED.
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer, 0, sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->inline_entry;
+    buffer->mask = AESDCHAR_INLINE_CAPACITY - 1;
+    buffer->depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+ * @return  true if the retention policy of @param buffer requires dropping its oldest entry,
+ *          either to make room for @param incoming (if not NULL) or because the entry has expired
+ *          at time @param now.
+ */
+static bool must_evict(
+    const struct aesd_circular_buffer *buffer,
+    const struct aesd_buffer_entry *incoming,
+    uint64_t now
+) {
+    size_t count = aesd_circular_buffer_count(buffer);
+    if (count == 0) {
+        return false;
+    }
+    size_t incoming_count = incoming != NULL ? 1 : 0;
+    size_t incoming_size = incoming != NULL ? incoming->size : 0;
+    const struct aesd_buffer_entry *oldest = &buffer->entry[buffer->out_offs];
+
+    if (count + incoming_count > buffer->depth) {
+        return true;
+    }
+    if (
+        buffer->max_bytes != 0
+        && buffer->total_size + incoming_size > buffer->max_bytes
+        && count + incoming_count > 1
+    ) {
+        return true;
+    }
+    return buffer->max_age != 0 && now > oldest->stamp && now - oldest->stamp > buffer->max_age;
+}
+
+/**
+ * @brief   Removes the oldest entry from @param buffer if the retention policy of the buffer
+ *          requires it, either to make room for @param incoming or because the entry has expired.
+ *
+ * Call repeatedly until it returns false to evict every entry the policy requires:
+ * - depth: the buffer may hold at most depth entries, including @param incoming.
+ * - max_bytes: the buffer may hold at most max_bytes, including @param incoming.
+ * - max_age: entries older than max_age relative to @param now are dropped.
+ *
+ * Any necessary locking must be handled by the caller.
+ *
+ * @param   incoming The entry about to be added with aesd_circular_buffer_add_entry(), or NULL
+ *              to only trim the buffer to its current limits (e.g. after changing them).
+ * @param   now The current time in the units of aesd_buffer_entry.stamp.
+ * @param   evicted Location to copy the evicted entry to, so its memory can be freed.
+ *
+ * @return  true if an entry was evicted, false if the buffer satisfies its retention policy.
+ */
+bool aesd_circular_buffer_evict_entry(
+    struct aesd_circular_buffer *buffer,
+    const struct aesd_buffer_entry *incoming,
+    uint64_t now,
+    struct aesd_buffer_entry *evicted
+) {
+    if (!must_evict(buffer, incoming, now)) {
+        return false;
+    }
+    return aesd_circular_buffer_remove_entry(buffer, evicted);
+}
+
+/**
+ * @brief   Finds when the oldest entry of @param buffer expires under its max_age, so a caller
+ *          can trim the buffer with aesd_circular_buffer_evict_entry() at that time without
+ *          waiting for another entry to be added.
+ *
+ * Any necessary locking must be handled by the caller.
+ *
+ * @param   expiry Location to store the earliest time, in the units of aesd_buffer_entry.stamp,
+ *              at which aesd_circular_buffer_evict_entry() drops the oldest entry for its age.
+ *
+ * @return  true if @param expiry was set, false if the buffer is empty or has no max_age.
+ */
+bool aesd_circular_buffer_expiry(const struct aesd_circular_buffer *buffer, uint64_t *expiry)
+{
+    if (buffer->max_age == 0 || aesd_circular_buffer_count(buffer) == 0) {
+        return false;
+    }
+    *expiry = buffer->entry[buffer->out_offs].stamp + buffer->max_age + 1;
+    return true;
+}
+
+/**
+ * @brief   Adds the @param count entries of @param entries to @param buffer in order, evicting
+ *          as many old entries as the retention policy requires along the way.
+ *
+ * - The stamp of each entry is used as the current time when checking max_age.
+ * - Any necessary locking must be handled by the caller. Evicted data is returned rather than
+ *   freed, so the caller can free it after releasing its lock.
+ * - Insertion stops early if @param evicted runs out of room. The entries not inserted can be
+ *   passed to another call once the evicted data has been dealt with. Sizing @param evicted for
+ *   aesd_circular_buffer_count() + @param count pointers guarantees every entry is inserted.
+ *
+ * @param   evicted Array to store pointers to the data of every evicted entry.
+ * @param   evicted_count On input, the number of pointers @param evicted can hold. On return,
+ *              the number of pointers stored.
+ *
+ * @return  The number of entries inserted.
+ */
+size_t aesd_circular_buffer_add_entries(
+    struct aesd_circular_buffer *buffer,
+    const struct aesd_buffer_entry *entries,
+    size_t count,
+    const char **evicted,
+    size_t *evicted_count
+) {
+    size_t evicted_len = *evicted_count;
+    size_t inserted = 0;
+    *evicted_count = 0;
+    for (; inserted < count; inserted++) {
+        const struct aesd_buffer_entry *entry = &entries[inserted];
+        while (must_evict(buffer, entry, entry->stamp)) {
+            if (*evicted_count == evicted_len) {
+                return inserted;
+            }
+            evicted[(*evicted_count)++] = drop_oldest_entry(buffer);
+        }
+        // Room was made above, so nothing is overwritten here
+        aesd_circular_buffer_add_entry(buffer, entry);
+    }
+    return inserted;
+}
+
+/**
+ * @brief   Removes the oldest entry from @param buffer. Any necessary locking must be handled by
+ *          the caller.
+ *
+ * @param   removed Location to copy the removed entry to, so its memory can be freed.
+ *
+ * @return  true if an entry was removed, false if the buffer was empty.
+ */
+bool aesd_circular_buffer_remove_entry(
+    struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_entry *removed
+) {
+    if (aesd_circular_buffer_count(buffer) == 0) {
+        return false;
+    }
+    *removed = buffer->entry[buffer->out_offs];
+    drop_oldest_entry(buffer);
+    return true;
+}
+
+/**
+ * @brief   Changes the depth of @param buffer, moving its entries to @param storage in order.
+ *
+ * - Any necessary locking must be handled by the caller.
+ * - @param capacity must be a power of two no smaller than @param depth, see
+ *   aesd_circular_buffer_capacity_for_depth().
+ * - The buffer must not hold more than @param depth entries, use
+ *   aesd_circular_buffer_remove_entry() to drop the oldest ones first.
+ *
+ * @param   storage Array of @param capacity slots to move the entries to, or NULL to use the
+ *              inline storage (in which case @param depth must not exceed
+ *              AESDCHAR_INLINE_CAPACITY). Must remain valid until the next resize.
+ *
+ * @return  The storage previously used by the buffer to be freed by the user, or NULL if that
+ *          was the inline storage or is still in use.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_resize(
+    struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_entry *storage,
+    size_t capacity,
+    size_t depth
+) {
+    struct aesd_buffer_entry *result = NULL;
+    size_t count = aesd_circular_buffer_count(buffer);
+    if (storage == NULL) {
+        storage = buffer->inline_entry;
+        capacity = AESDCHAR_INLINE_CAPACITY;
+    }
+    if (storage != buffer->entry) {
+        // Copy the entries out in order so the new ring starts at slot zero
+        for (size_t i = 0; i < capacity; i++) {
+            if (i < count) {
+                storage[i] = buffer->entry[(buffer->out_offs + i) & buffer->mask];
+            } else {
+                memset(&storage[i], 0, sizeof(storage[i]));
+            }
+        }
+        if (buffer->entry != buffer->inline_entry) {
+            result = buffer->entry;
+        }
+        buffer->entry = storage;
+        buffer->mask = capacity - 1;
+        buffer->out_offs = 0;
+        buffer->in_offs = count & buffer->mask;
+    }
+    buffer->depth = depth;
+    buffer->full = count == depth;
+    return result;
 }
 
 struct aesd_buffer_entry *aesd_circular_buffer_get_entry_at_out_index(
     struct aesd_circular_buffer *buffer,
     size_t i
 ) {
-    size_t out_index = (buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    struct aesd_buffer_entry *result = &buffer->entry[out_index];
-    if (result->buffptr == NULL) {
-        result = NULL;
+    return aesd_buffer_index_get_entry_at_out_index(&buffer->index, i);
+}
+
+struct aesd_buffer_entry *aesd_buffer_index_get_entry_at_out_index(
+    const struct aesd_buffer_index *buffer,
+    size_t i
+) {
+    if (i >= aesd_buffer_index_count(buffer)) {
+        return NULL;
     }
-    return result;
+    size_t out_index = (buffer->out_offs + i) & buffer->mask;
+    return &buffer->entry[out_index];
+}
+
+size_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    return aesd_buffer_index_count(&buffer->index);
+}
+
+size_t aesd_buffer_index_count(const struct aesd_buffer_index *buffer)
+{
+    if (buffer->full) {
+        return buffer->depth;
+    }
+    return (buffer->in_offs - buffer->out_offs) & buffer->mask;
 }
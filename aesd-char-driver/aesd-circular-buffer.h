@@ -10,13 +10,38 @@
 
 #ifdef __KERNEL__
 #include <linux/types.h>
+#include <linux/uio.h> // kvec
 #else
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
+#include <sys/uio.h> // iovec
 #endif
 
+/**
+ * I/O vector type filled by aesd_circular_buffer_fill_iovec(). Both have iov_base and iov_len
+ * members, so the result can be passed straight to kernel_sendmsg(), iov_iter_kvec(), writev()
+ * or sendmsg().
+ */
+#ifdef __KERNEL__
+#define aesd_iovec kvec
+#else
+#define aesd_iovec iovec
+#endif
+
+/**
+ * Default number of entries retained by a buffer, used by aesd_circular_buffer_init()
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Number of entry slots embedded in struct aesd_circular_buffer. Must be a power of two no
+ * smaller than AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED.
+ */
+#define AESDCHAR_INLINE_CAPACITY 16
+/**
+ * Largest depth accepted by aesd_circular_buffer_resize()
+ */
+#define AESDCHAR_MAX_DEPTH (1U << 16)
 
 struct aesd_buffer_entry
 {
@@ -28,33 +53,153 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Cumulative number of bytes added to the buffer before this entry. Maintained by
+     * aesd_circular_buffer_add_entry(), any value set by the caller is overwritten.
+     */
+    size_t stream_offs;
+    /**
+     * Time the entry was added, in caller-defined units. Compared against max_age of the buffer
+     * by aesd_circular_buffer_evict_entry().
+     */
+    uint64_t stamp;
 };
 
+/**
+ * Declares the @param ... members both directly in the enclosing struct and as a struct
+ * @param TAG named @param NAME occupying the same memory, like struct_group_tagged() in the
+ * kernel, so they can be copied together.
+ */
+#define AESD_STRUCT_GROUP(TAG, NAME, ...) \
+    union { \
+        struct { __VA_ARGS__ }; \
+        struct TAG { __VA_ARGS__ } NAME; \
+    }
+
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * Everything describing the entries, without their inline storage. It can be copied on its
+     * own as a struct aesd_buffer_index, for example to take a consistent snapshot of a buffer
+     * being updated, and looked up with the aesd_buffer_index functions.
      */
-    struct aesd_buffer_entry entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    AESD_STRUCT_GROUP(aesd_buffer_index, index,
+        /**
+         * An array of pointers to memory allocated for the most recent write operations.
+         * Points at either inline_entry or storage handed over by
+         * aesd_circular_buffer_resize(), and holds mask + 1 slots.
+         */
+        struct aesd_buffer_entry *entry;
+        /**
+         * The current location in the entry structure where the next write should
+         * be stored.
+         */
+        size_t in_offs;
+        /**
+         * The first location in the entry structure to read from
+         */
+        size_t out_offs;
+        /**
+         * set to true when the buffer holds depth entries
+         */
+        bool full;
+        /**
+         * Maximum number of entries retained before the oldest is overwritten
+         */
+        size_t depth;
+        /**
+         * Number of slots in entry minus one. The slot count is a power of two so indices
+         * wrap with a mask.
+         */
+        size_t mask;
+        /**
+         * Maximum total number of bytes retained, or 0 for no limit. The most recent entry is
+         * always retained even if it exceeds this limit on its own.
+         */
+        size_t max_bytes;
+        /**
+         * Maximum age of a retained entry in the units of aesd_buffer_entry.stamp, or 0 for no
+         * limit
+         */
+        uint64_t max_age;
+        /**
+         * The stream_offs value of the entry at out_offs, i.e. the cumulative number of bytes
+         * dropped from the buffer so far
+         */
+        size_t base_offs;
+        /**
+         * Total number of bytes stored across all valid entries
+         */
+        size_t total_size;
+    );
     /**
-     * The current location in the entry structure where the next write should
-     * be stored.
+     * Default storage for entry, used until the buffer is resized beyond it. Because entry
+     * may point here, a struct aesd_circular_buffer must not be copied by value. Copy its
+     * index instead.
      */
-    uint8_t in_offs;
+    struct aesd_buffer_entry inline_entry[AESDCHAR_INLINE_CAPACITY];
+};
+
+/**
+ * A position in a buffer remembered between lookups, so a reader moving through the buffer in
+ * order continues from it without searching. Only a hint: it is checked against the buffer on
+ * every use, so a stale cursor, or one torn by a racing update, just costs a search.
+ */
+struct aesd_buffer_cursor
+{
+    /**
+     * Slot in entry of the entry holding the position. Unlike an index counted from out_offs, it
+     * doesn't change when older entries are dropped.
+     */
+    size_t slot;
     /**
-     * The first location in the entry structure to read from
+     * The byte of that entry at the position
      */
-    uint8_t out_offs;
+    size_t offset;
     /**
-     * set to true when the buffer entry structure is full
+     * The stream_offs of that entry, which identifies it among every entry ever added, so a
+     * cursor whose slot was reused or moved by a resize no longer matches
      */
-    bool full;
+    size_t stream_offs;
 };
 
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
     struct aesd_circular_buffer *buffer, size_t char_offset, size_t *entry_offset_byte_rtn
 );
 
+struct aesd_buffer_entry *aesd_buffer_index_find_entry_offset_for_fpos(
+    const struct aesd_buffer_index *buffer, size_t char_offset, size_t *entry_offset_byte_rtn
+);
+
+size_t aesd_circular_buffer_fill_iovec(
+    struct aesd_circular_buffer *buffer,
+    size_t char_offset,
+    size_t count,
+    struct aesd_iovec *iov,
+    size_t iov_len,
+    size_t *bytes_rtn
+);
+
+size_t aesd_circular_buffer_fill_iovec_cursor(
+    struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_cursor *cursor,
+    size_t char_offset,
+    size_t count,
+    struct aesd_iovec *iov,
+    size_t iov_len,
+    size_t *bytes_rtn
+);
+
+size_t aesd_buffer_index_fill_iovec_cursor(
+    const struct aesd_buffer_index *buffer,
+    struct aesd_buffer_cursor *cursor,
+    size_t char_offset,
+    size_t count,
+    struct aesd_iovec *iov,
+    size_t iov_len,
+    size_t *bytes_rtn
+);
+
 const char *aesd_circular_buffer_add_entry(
     struct aesd_circular_buffer *buffer,
     const struct aesd_buffer_entry *entry
@@ -62,19 +207,102 @@ const char *aesd_circular_buffer_add_entry(
 
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+size_t aesd_circular_buffer_add_entries(
+    struct aesd_circular_buffer *buffer,
+    const struct aesd_buffer_entry *entries,
+    size_t count,
+    const char **evicted,
+    size_t *evicted_count
+);
+
+bool aesd_circular_buffer_evict_entry(
+    struct aesd_circular_buffer *buffer,
+    const struct aesd_buffer_entry *incoming,
+    uint64_t now,
+    struct aesd_buffer_entry *evicted
+);
+
+bool aesd_circular_buffer_expiry(const struct aesd_circular_buffer *buffer, uint64_t *expiry);
+
+bool aesd_circular_buffer_remove_entry(
+    struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_entry *removed
+);
+
+struct aesd_buffer_entry *aesd_circular_buffer_resize(
+    struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_entry *storage,
+    size_t capacity,
+    size_t depth
+);
+
 struct aesd_buffer_entry *aesd_circular_buffer_get_entry_at_out_index(
     struct aesd_circular_buffer *buffer,
     size_t i
 );
 
+struct aesd_buffer_entry *aesd_buffer_index_get_entry_at_out_index(
+    const struct aesd_buffer_index *buffer,
+    size_t i
+);
+
+/**
+ * @return  The number of valid entries in @param buffer
+ */
+size_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+size_t aesd_buffer_index_count(const struct aesd_buffer_index *buffer);
+
+/**
+ * @return  The number of slots needed to hold @param depth entries, rounded up to a power of two
+ *          as required by aesd_circular_buffer_resize().
+ */
+static inline size_t aesd_circular_buffer_capacity_for_depth(size_t depth)
+{
+    size_t capacity = 1;
+    while (capacity < depth) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+/**
+ * @return  The total number of bytes stored in @param buffer, i.e. the size of all entries
+ *          concatenated end to end.
+ */
+static inline size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->total_size;
+}
+
+/**
+ * @return  The zero referenced character index of the first byte of @param entry if all buffer
+ *          strings were concatenated end to end. @param entry must be a valid entry of
+ *          @param buffer.
+ */
+static inline size_t aesd_circular_buffer_entry_fpos(
+    const struct aesd_circular_buffer *buffer,
+    const struct aesd_buffer_entry *entry
+) {
+    return entry->stream_offs - buffer->base_offs;
+}
+
+static inline size_t aesd_buffer_index_entry_fpos(
+    const struct aesd_buffer_index *buffer,
+    const struct aesd_buffer_entry *entry
+) {
+    return entry->stream_offs - buffer->base_offs;
+}
+
 /**
- * Create a for loop to iterate over each member of the circular buffer.
- * Useful when you've allocated memory for circular buffer entries and need to free it
+ * Create a for loop to iterate over each slot of the circular buffer.
+ * Useful when you've allocated memory for circular buffer entries and need to free it. Unused
+ * slots have a NULL buffptr.
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a size_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * size_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -84,7 +312,7 @@ struct aesd_buffer_entry *aesd_circular_buffer_get_entry_at_out_index(
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr, buffer, index) \
     for ( \
         index = 0, entryptr = &((buffer)->entry[index]); \
-        index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+        index <= (buffer)->mask; \
         index++, entryptr = &((buffer)->entry[index]) \
     )
 
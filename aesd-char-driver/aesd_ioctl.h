@@ -33,14 +33,192 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * A structure to be passed by IOCTL between user space and kernel space, describing the write
+ * commands held by the aesdchar driver without transferring their data
+ */
+struct aesd_metadata {
+    /**
+     * Returns the total number of bytes held
+     */
+    uint64_t total_bytes;
+    /**
+     * Returns the number of bytes written through the calling file since its last newline, which
+     * are not part of the history yet
+     */
+    uint64_t pending_bytes;
+    /**
+     * Returns the number of write command 0, counted from the first write command to the device.
+     * Write command n has number first_seq + n.
+     */
+    uint64_t first_seq;
+    /**
+     * Returns the number of write commands held
+     */
+    uint32_t entry_count;
+    /**
+     * The zero referenced write command described by lengths[0]
+     */
+    uint32_t first_entry;
+    /**
+     * The number of elements of lengths, returns the number of elements filled
+     */
+    uint32_t lengths_len;
+    uint32_t reserved;
+    /**
+     * User space pointer to an array of uint64_t filled with the size of each write command
+     * from first_entry on, or 0 for none
+     */
+    uint64_t lengths;
+};
+
+/**
+ * A structure to be passed by IOCTL from user space to kernel space, describing a range of write
+ * commands to copy out of the aesdchar driver and where to copy them
+ */
+struct aesd_records {
+    /**
+     * The zero referenced write command to copy first
+     */
+    uint32_t first_record;
+    /**
+     * The maximum number of write commands to copy
+     */
+    uint32_t max_records;
+    /**
+     * User space pointer to the buffer receiving the write commands. For n write commands copied,
+     * it starts with n uint64_t holding their sizes, followed by their data back to back.
+     */
+    uint64_t buf;
+    /**
+     * The size of buf in bytes
+     */
+    uint64_t buf_len;
+};
+
+/**
+ * A structure to be passed by IOCTL from user space to kernel space, describing the retention
+ * policy used to evict old write commands from the aesdchar driver
+ */
+struct aesd_policy {
+    /**
+     * The maximum number of write commands retained, or 0 to leave the current depth unchanged
+     */
+    uint32_t max_entries;
+    /**
+     * The maximum age of a retained write command in milliseconds, or 0 for no limit. Write
+     * commands are dropped once they exceed it, even if nothing else is written to the device.
+     */
+    uint32_t max_age_ms;
+    /**
+     * The maximum total number of bytes retained, or 0 for no limit. The most recent write
+     * command is always retained.
+     */
+    uint64_t max_bytes;
+};
+
+/**
+ * Describes one write command in the entry table of struct aesd_mmap_header
+ */
+struct aesd_mmap_entry {
+    /**
+     * The stream offset of the first byte of the write command
+     */
+    uint64_t offs;
+    /**
+     * The number of bytes in the write command
+     */
+    uint64_t size;
+};
+
+/**
+ * The header at the start of a read-only mmap of an aesdchar device loaded with arena storage.
+ *
+ * The data ring follows the header at offset header_size. Byte n of the history stream, counted
+ * from the first write to the device, is at data[n & (data_size - 1)] and the current history is
+ * the bytes from tail up to head. Write command s, counted from the first write command, is
+ * described by entries[s & (entries_len - 1)] for every s from tail_seq up to head_seq. Older
+ * write commands still in the history are only found by scanning the data.
+ *
+ * The driver updates the mapping while it is in use. generation is odd while an update is in
+ * progress and changes with every update, so consumers read it before and after accessing the
+ * mapping, with read barriers in between, and retry if it was odd or changed.
+ */
+struct aesd_mmap_header {
+    /**
+     * Incremented before and after every update of the mapping
+     */
+    uint32_t generation;
+    /**
+     * The offset of the data ring in the mapping, a multiple of the page size
+     */
+    uint32_t header_size;
+    /**
+     * The size of the data ring, a power of two
+     */
+    uint64_t data_size;
+    /**
+     * The stream offset of the oldest byte in the history
+     */
+    uint64_t tail;
+    /**
+     * The stream offset one past the newest byte in the history
+     */
+    uint64_t head;
+    /**
+     * The number of the oldest write command described in entries
+     */
+    uint64_t tail_seq;
+    /**
+     * The number of the next write command to be committed
+     */
+    uint64_t head_seq;
+    /**
+     * The number of slots in entries, a power of two
+     */
+    uint32_t entries_len;
+    uint32_t reserved;
+    struct aesd_mmap_entry entries[];
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Get the totals of the device and the size of each write command in a range, all from the same
+ * point in time, so a client can find the arguments for AESDCHAR_IOCSEEKTO without reading
+ */
+#define AESDCHAR_IOCGMETADATA _IOWR(AESD_IOC_MAGIC, 6, struct aesd_metadata)
+/**
+ * Set the number of write commands retained by the device. Existing entries are kept, dropping
+ * the oldest ones if the new depth is smaller than the number of entries held.
+ */
+#define AESDCHAR_IOCSDEPTH _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+/**
+ * Set the retention policy of the device, evicting any write commands it no longer allows
+ */
+#define AESDCHAR_IOCSPOLICY _IOW(AESD_IOC_MAGIC, 3, struct aesd_policy)
+/**
+ * Create a new aesdchar device instance at the lowest free minor, returning its index n so it
+ * can be opened as /dev/aesdcharn. Requires CAP_SYS_ADMIN.
+ */
+#define AESDCHAR_IOCCREATE _IO(AESD_IOC_MAGIC, 4)
+/**
+ * Destroy the aesdchar device instance with the given index. Files already open on it keep their
+ * history until they are closed. Requires CAP_SYS_ADMIN.
+ */
+#define AESDCHAR_IOCDESTROY _IOW(AESD_IOC_MAGIC, 5, uint32_t)
+/**
+ * Copy as many whole write commands of the given range as fit to a user buffer, returning how
+ * many were copied. Returns -EMSGSIZE if the first one doesn't fit, 0 if the range is empty.
+ * Independent of the file position.
+ */
+#define AESDCHAR_IOCRECORDS _IOW(AESD_IOC_MAGIC, 7, struct aesd_records)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 7
 
 #endif /* AESD_IOCTL_H */
@@ -10,7 +10,9 @@
 
 #include "aesd-circular-buffer.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+// Define AESD_DEBUG to log every step to the console, or build with DEBUG=y. The tracepoints in
+// aesdchar_trace.h cover the hot path at near zero cost while disabled.
+//#define AESD_DEBUG 1
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -25,13 +27,193 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+struct aesd_mmap_header;
+
+/**
+ * Number of entries each per-CPU shard holds before its writers merge it into the history
+ * themselves, a power of two
+ */
+#define AESD_SHARD_ENTRIES 64
+
+/**
+ * Entries committed on one CPU in sharded mode and not yet merged into the history, oldest first
+ */
+struct aesd_shard
+{
+    spinlock_t lock;
+    struct aesd_buffer_entry entry[AESD_SHARD_ENTRIES];
+    /**
+     * Position of each entry in the order of commits across all shards
+     */
+    u64 seq[AESD_SHARD_ENTRIES];
+    unsigned int out;
+    unsigned int count;
+};
+
+/**
+ * Operations timed by struct aesd_stats
+ */
+enum aesd_op
+{
+    AESD_OP_READ,
+    AESD_OP_WRITE,
+    AESD_OPS,
+};
+
+/**
+ * Locks whose contention is counted by struct aesd_stats
+ */
+enum aesd_lock
+{
+    AESD_LOCK_BUF,
+    AESD_LOCK_ENTRY,
+    AESD_LOCKS,
+};
+
+/**
+ * Number of buckets in each latency histogram, bucket i counting calls that took from 2^(i-1) up
+ * to 2^i ns and the last one every longer call
+ */
+#define AESD_LATENCY_BUCKETS 32
+
+/**
+ * Counters of one CPU for a device, summed over every CPU when read
+ */
+struct aesd_stats
+{
+    unsigned long calls[AESD_OPS];
+    unsigned long bytes[AESD_OPS];
+    unsigned long latency[AESD_OPS][AESD_LATENCY_BUCKETS];
+    /**
+     * Entries committed to the history and entries dropped from it
+     */
+    unsigned long records;
+    unsigned long evictions;
+    /**
+     * Change in the number of bytes staged by open files as incomplete lines, so it can go
+     * negative on one CPU
+     */
+    long pending_bytes;
+    /**
+     * Lock acquisitions that had to wait, and the total time spent waiting
+     */
+    unsigned long lock_contended[AESD_LOCKS];
+    u64 lock_wait_ns[AESD_LOCKS];
+};
+
 struct aesd_dev
 {
     struct aesd_circular_buffer buf;
     struct mutex buf_lock;
-    struct cdev cdev;
+    /**
+     * Sequence counter around every change to buf, made with buf_lock held, so readers can look
+     * up entries without taking the lock
+     */
+    seqcount_mutex_t buf_seq;
+    /**
+     * Held for reading while entries found through buf_seq are in use. Heap mode entry data and
+     * entry storage replaced by a resize are only freed after a grace period.
+     */
+    struct srcu_struct srcu;
+    /**
+     * Allocated with cdev_alloc() so it can outlive the device once it is destroyed
+     */
+    struct cdev *cdev;
+    /**
+     * Held by the device table and by every open file, the device is freed with the last one
+     */
+    struct kref ref;
+    /**
+     * Device number of the instance, identifying it in tracepoints
+     */
+    dev_t devt;
+    /**
+     * Preallocated byte ring holding the data of every entry when arena storage is enabled, or
+     * NULL when each entry is allocated separately. Byte n of the history stream, counted from
+     * the first write, lives at arena[n & arena_mask].
+     */
+    char *arena;
+    size_t arena_mask;
+    /**
+     * Page mapped by aesd_mmap() in front of the arena describing the history, or NULL when
+     * arena storage is disabled. The arena is allocated right after it.
+     */
+    struct aesd_mmap_header *mmap_header;
+    /**
+     * Number of entries committed to buf since the device was loaded, including those merged from
+     * the shards. Written with buf_lock held, read without it by readers waiting for new entries.
+     */
+    u64 entry_seq;
+    /**
+     * Per-CPU rings new entries are committed to without taking buf_lock in sharded mode, or
+     * NULL when entries are committed to buf directly. Entries are merged into buf in commit
+     * order, entry_seq counting the ones merged, before anything reads buf.
+     */
+    struct aesd_shard __percpu *shards;
+    /**
+     * Number of entries committed to the shards since the device was loaded, which also numbers
+     * them in commit order
+     */
+    atomic64_t shard_seq;
+    /**
+     * Room for every entry the shards can hold, used by the merge with buf_lock held
+     */
+    struct aesd_buffer_entry *merge_entries;
+    /**
+     * Merges the shards in the background once one of them is half full
+     */
+    struct work_struct merge_work;
+    /**
+     * Drops entries from buf once they exceed its max_age, pending while any entry can expire
+     */
+    struct delayed_work expire_work;
+    /**
+     * Per-CPU counters, reported in the stats file of the debugfs directory of the device
+     */
+    struct aesd_stats __percpu *stats;
+    struct dentry *debugfs;
+    /**
+     * Readers waiting for new entries
+     */
+    wait_queue_head_t wait;
+    /**
+     * Processes signalled with SIGIO when new entries are committed
+     */
+    struct fasync_struct *async_queue;
+};
+
+/**
+ * State of one open file, stored in its private_data
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    /**
+     * Data written through this file since its last newline, committed to buf once the line is
+     * complete or the file is closed
+     */
     struct aesd_buffer_entry entry;
+    /**
+     * Number of bytes allocated for the data of entry, at least entry.size
+     */
+    size_t entry_capacity;
+    /**
+     * Serializes writes through this file
+     */
     struct mutex entry_lock;
+    /**
+     * Set when a read finds no data at the file position, recording that position in eof_fpos
+     * and the stream offset where the data ended in eof_offs. Protected by buf_lock of dev,
+     * except that seeks clear at_eof without it.
+     */
+    bool at_eof;
+    loff_t eof_fpos;
+    size_t eof_offs;
+    /**
+     * Where the last heap mode read of this file ended, so the next one continues from there
+     * without searching the buffer. Updated without a lock, which is fine as it's checked on use.
+     */
+    struct aesd_buffer_cursor cursor;
 };
 
 
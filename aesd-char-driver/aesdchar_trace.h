@@ -0,0 +1,233 @@
+/**
+ * @file aesdchar_trace.h
+ * @brief Tracepoints of the AESD char driver
+ *
+ * The events are in the aesdchar group of the tracing filesystem, for example
+ * /sys/kernel/tracing/events/aesdchar/aesd_write, and are compiled to a single not taken branch
+ * while disabled. Every event identifies the device instance by its device number.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_
+
+#include <linux/kdev_t.h>
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+#include "aesdchar.h"
+
+TRACE_DEFINE_ENUM(AESD_LOCK_BUF);
+TRACE_DEFINE_ENUM(AESD_LOCK_ENTRY);
+
+#define show_aesd_lock(which) __print_symbolic( \
+    which, \
+    {AESD_LOCK_BUF, "buf_lock"}, \
+    {AESD_LOCK_ENTRY, "entry_lock"} \
+)
+
+TRACE_EVENT(aesd_open,
+    TP_PROTO(struct aesd_dev *dev, unsigned int flags),
+    TP_ARGS(dev, flags),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(unsigned int, flags)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->devt;
+        __entry->flags = flags;
+    ),
+    TP_printk("dev %d:%d flags %#x", MAJOR(__entry->devt), MINOR(__entry->devt), __entry->flags)
+);
+
+/**
+ * A read or write of @param count bytes at file position @param pos, fired once it returns
+ * @param result
+ */
+DECLARE_EVENT_CLASS(aesd_io,
+    TP_PROTO(struct aesd_dev *dev, loff_t pos, size_t count, ssize_t result),
+    TP_ARGS(dev, pos, count, result),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, result)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->devt;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->result = result;
+    ),
+    TP_printk(
+        "dev %d:%d pos %lld count %zu result %zd",
+        MAJOR(__entry->devt), MINOR(__entry->devt), __entry->pos, __entry->count, __entry->result
+    )
+);
+
+DEFINE_EVENT(aesd_io, aesd_read,
+    TP_PROTO(struct aesd_dev *dev, loff_t pos, size_t count, ssize_t result),
+    TP_ARGS(dev, pos, count, result)
+);
+
+DEFINE_EVENT(aesd_io, aesd_write,
+    TP_PROTO(struct aesd_dev *dev, loff_t pos, size_t count, ssize_t result),
+    TP_ARGS(dev, pos, count, result)
+);
+
+TRACE_EVENT(aesd_llseek,
+    TP_PROTO(struct aesd_dev *dev, loff_t offset, int whence, loff_t result),
+    TP_ARGS(dev, offset, whence, result),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(loff_t, offset)
+        __field(int, whence)
+        __field(loff_t, result)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->devt;
+        __entry->offset = offset;
+        __entry->whence = whence;
+        __entry->result = result;
+    ),
+    TP_printk(
+        "dev %d:%d offset %lld whence %s result %lld",
+        MAJOR(__entry->devt), MINOR(__entry->devt), __entry->offset,
+        __print_symbolic(
+            __entry->whence, {SEEK_SET, "SEEK_SET"}, {SEEK_CUR, "SEEK_CUR"}, {SEEK_END, "SEEK_END"}
+        ),
+        __entry->result
+    )
+);
+
+/**
+ * @param count entries holding @param bytes bytes committed by one write, numbered from
+ * @param seq in commit order. In sharded mode they're merged into the history later.
+ */
+TRACE_EVENT(aesd_commit,
+    TP_PROTO(struct aesd_dev *dev, u64 seq, size_t count, size_t bytes),
+    TP_ARGS(dev, seq, count, bytes),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(u64, seq)
+        __field(size_t, count)
+        __field(size_t, bytes)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->devt;
+        __entry->seq = seq;
+        __entry->count = count;
+        __entry->bytes = bytes;
+    ),
+    TP_printk(
+        "dev %d:%d seq %llu count %zu bytes %zu",
+        MAJOR(__entry->devt), MINOR(__entry->devt), __entry->seq, __entry->count, __entry->bytes
+    )
+);
+
+/**
+ * @param count of the oldest entries holding @param bytes bytes dropped from the history, leaving
+ * it starting at stream offset @param tail
+ */
+TRACE_EVENT(aesd_evict,
+    TP_PROTO(struct aesd_dev *dev, size_t count, size_t bytes, size_t tail),
+    TP_ARGS(dev, count, bytes, tail),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(size_t, count)
+        __field(size_t, bytes)
+        __field(size_t, tail)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->devt;
+        __entry->count = count;
+        __entry->bytes = bytes;
+        __entry->tail = tail;
+    ),
+    TP_printk(
+        "dev %d:%d count %zu bytes %zu tail %zu",
+        MAJOR(__entry->devt), MINOR(__entry->devt), __entry->count, __entry->bytes, __entry->tail
+    )
+);
+
+TRACE_EVENT(aesd_seekto,
+    TP_PROTO(
+        struct aesd_dev *dev, u32 write_cmd, u32 write_cmd_offset, loff_t f_pos, long result
+    ),
+    TP_ARGS(dev, write_cmd, write_cmd_offset, f_pos, result),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(u32, write_cmd)
+        __field(u32, write_cmd_offset)
+        __field(loff_t, f_pos)
+        __field(long, result)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->devt;
+        __entry->write_cmd = write_cmd;
+        __entry->write_cmd_offset = write_cmd_offset;
+        __entry->f_pos = f_pos;
+        __entry->result = result;
+    ),
+    TP_printk(
+        "dev %d:%d write_cmd %u write_cmd_offset %u f_pos %lld result %ld",
+        MAJOR(__entry->devt), MINOR(__entry->devt), __entry->write_cmd,
+        __entry->write_cmd_offset, __entry->f_pos, __entry->result
+    )
+);
+
+/**
+ * A lock that was found held, fired before waiting for it
+ */
+TRACE_EVENT(aesd_lock_wait_begin,
+    TP_PROTO(struct aesd_dev *dev, enum aesd_lock which),
+    TP_ARGS(dev, which),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(int, which)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->devt;
+        __entry->which = which;
+    ),
+    TP_printk(
+        "dev %d:%d lock %s", MAJOR(__entry->devt), MINOR(__entry->devt),
+        show_aesd_lock(__entry->which)
+    )
+);
+
+/**
+ * The end of a wait of @param wait_ns for a lock, @param result being -ERESTARTSYS if a signal
+ * interrupted it
+ */
+TRACE_EVENT(aesd_lock_wait_end,
+    TP_PROTO(struct aesd_dev *dev, enum aesd_lock which, u64 wait_ns, int result),
+    TP_ARGS(dev, which, wait_ns, result),
+    TP_STRUCT__entry(
+        __field(dev_t, devt)
+        __field(int, which)
+        __field(u64, wait_ns)
+        __field(int, result)
+    ),
+    TP_fast_assign(
+        __entry->devt = dev->devt;
+        __entry->which = which;
+        __entry->wait_ns = wait_ns;
+        __entry->result = result;
+    ),
+    TP_printk(
+        "dev %d:%d lock %s wait_ns %llu result %d", MAJOR(__entry->devt), MINOR(__entry->devt),
+        show_aesd_lock(__entry->which), __entry->wait_ns, __entry->result
+    )
+);
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_ */
+
+// The header is read again by define_trace.h from this directory, see CFLAGS_main.o in Makefile
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
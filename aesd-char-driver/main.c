@@ -11,258 +11,1742 @@
  *
  */
 
+#include <linux/capability.h>
 #include <linux/cdev.h>
+#include <linux/debugfs.h>
+#include <linux/device.h> // class_create, device_create
 #include <linux/fs.h> // file_operations
 #include <linux/init.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/kref.h>
+#include <linux/log2.h> // roundup_pow_of_two
+#include <linux/mm.h> // kvmalloc
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/overflow.h> // struct_size
+#include <linux/percpu.h>
+#include <linux/poll.h>
 #include <linux/printk.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/srcu.h>
 #include <linux/string.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h> // iov_iter, kvec
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
+
 MODULE_AUTHOR("DomenicP");
 MODULE_LICENSE("Dual BSD/GPL");
 
 int g_aesd_major = 0; // use dynamic major
 int g_aesd_minor = 0;
 
-struct aesd_dev g_aesd_device = {0};
+/**
+ * Number of minors reserved for device instances, the most that can exist at once
+ */
+#define AESD_MAX_INSTANCES 64
+
+/**
+ * Device instance of each minor, offset from g_aesd_minor, or NULL where none was created.
+ * Protected by g_aesd_devices_lock.
+ */
+static struct aesd_dev *g_aesd_devices[AESD_MAX_INSTANCES];
+static DEFINE_MUTEX(g_aesd_devices_lock);
+
+static struct class *g_aesd_class;
+
+static unsigned int instances = 1;
+module_param(instances, uint, 0444);
+MODULE_PARM_DESC(
+    instances, "Number of devices created at load, /dev/aesdchar0 onwards (default 1)"
+);
+
+static unsigned int depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(depth, uint, 0444);
+MODULE_PARM_DESC(depth, "Number of write commands retained (default 10)");
+
+static unsigned long max_bytes = 0;
+module_param(max_bytes, ulong, 0444);
+MODULE_PARM_DESC(max_bytes, "Total bytes retained across write commands, 0 for no limit");
+
+static unsigned int max_age_ms = 0;
+module_param(max_age_ms, uint, 0444);
+MODULE_PARM_DESC(
+    max_age_ms,
+    "Age in ms after which write commands are dropped, even if nothing is written, 0 for no limit"
+);
+
+static unsigned long arena_size = 0;
+module_param(arena_size, ulong, 0444);
+MODULE_PARM_DESC(
+    arena_size,
+    "Store all write commands in one preallocated ring of this many bytes, 0 to disable. "
+    "Required for mmap."
+);
+
+static bool follow = false;
+module_param(follow, bool, 0644);
+MODULE_PARM_DESC(
+    follow, "Block reads at the end of data until more is written, like tail -f (default off)"
+);
+
+static bool sharded = false;
+module_param(sharded, bool, 0444);
+MODULE_PARM_DESC(
+    sharded,
+    "Commit write commands to per-CPU rings, merged into the history in order when it is read. "
+    "Not supported with arena_size."
+);
+
+/**
+ * Most size classes of entry data that can be configured
+ */
+#define AESD_POOL_CLASSES 8
+
+static unsigned int pool_sizes[AESD_POOL_CLASSES] = {64, 128, 256, 512, 1024, 2048, 4096};
+static int pool_classes = 7;
+module_param_array_named(pool_sizes, pool_sizes, uint, &pool_classes, 0444);
+MODULE_PARM_DESC(
+    pool_sizes,
+    "Ascending sizes of up to 8 slab caches written data is allocated from, larger data "
+    "is allocated separately (default 64,128,256,512,1024,2048,4096)"
+);
+
+/**
+ * Number of entries aesd_read copies from per call to aesd_circular_buffer_fill_iovec()
+ */
+#define AESD_READ_IOVECS 8
+
+/**
+ * Size of the header describing the history in front of the arena in an mmap of the device
+ */
+#define AESD_MMAP_HEADER_SIZE PAGE_SIZE
+
+/**
+ * Number of lines a write can complete before the entries for them are allocated
+ */
+#define AESD_WRITE_LINES 8
+
+/**
+ * Number of evicted entries a write can defer freeing until after buf_lock is released
+ */
+#define AESD_EVICT_BATCH 16
+
+/**
+ * Slab cache of each size class in pool_sizes, shared by every device
+ */
+static struct kmem_cache *g_aesd_pool[AESD_POOL_CLASSES];
+static char g_aesd_pool_names[AESD_POOL_CLASSES][24];
+
+/**
+ * Allocations of entry data served by each size class, and ones too large for any of them
+ */
+struct aesd_pool_stats
+{
+    unsigned long hits[AESD_POOL_CLASSES];
+    unsigned long misses;
+};
+
+static DEFINE_PER_CPU(struct aesd_pool_stats, g_aesd_pool_stats);
+
+static struct dentry *g_aesd_debugfs;
+
+/**
+ * @return  The size class of entry data of @param size bytes, or -1 if it's too large for any.
+ */
+static int aesd_pool_class(size_t size)
+{
+    for (int i = 0; i < pool_classes && g_aesd_pool[i] != NULL; i++) {
+        if (size <= pool_sizes[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @return  The number of bytes aesd_data_alloc() allocates for @param size bytes of data.
+ */
+static size_t aesd_data_capacity(size_t size)
+{
+    int size_class = aesd_pool_class(size);
+    return size_class >= 0 ? pool_sizes[size_class] : size;
+}
+
+/**
+ * @brief   Allocate room for @param size bytes of heap mode entry data, without zeroing it.
+ *
+ * Data that fits a size class comes from its slab cache, where the data of evicted entries is
+ * returned for reuse, larger data from kvmalloc(). Either is freed with kvfree().
+ *
+ * @param   capacity_rtn Location to store the number of bytes allocated, at least @param size.
+ *
+ * @return  The allocation, or NULL on failure.
+ */
+static char *aesd_data_alloc(size_t size, size_t *capacity_rtn)
+{
+    int size_class = aesd_pool_class(size);
+    if (size_class < 0) {
+        this_cpu_inc(g_aesd_pool_stats.misses);
+        *capacity_rtn = size;
+        return kvmalloc(size, GFP_KERNEL);
+    }
+    this_cpu_inc(g_aesd_pool_stats.hits[size_class]);
+    *capacity_rtn = pool_sizes[size_class];
+    return kmem_cache_alloc(g_aesd_pool[size_class], GFP_KERNEL);
+}
+
+static int aesd_pool_show(struct seq_file *s, void *unused)
+{
+    seq_printf(s, "%-10s %12s\n", "size", "allocs");
+    for (int i = 0; i <= pool_classes; i++) {
+        unsigned long count = 0;
+        int cpu;
+        for_each_possible_cpu(cpu) {
+            struct aesd_pool_stats *stats = &per_cpu(g_aesd_pool_stats, cpu);
+            count += i < pool_classes ? stats->hits[i] : stats->misses;
+        }
+        if (i < pool_classes) {
+            seq_printf(s, "%-10u %12lu\n", pool_sizes[i], count);
+        } else {
+            seq_printf(s, "%-10s %12lu\n", "larger", count);
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_pool);
+
+/**
+ * @brief   Create the slab caches of the size classes in pool_sizes.
+ * @return  0 on success, or a negative error code.
+ */
+static int aesd_pool_init(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    for (int i = 0; i < pool_classes; i++) {
+        if (pool_sizes[i] == 0 || (i > 0 && pool_sizes[i] <= pool_sizes[i - 1])) {
+            printk(KERN_WARNING "pool_sizes must be ascending and positive\n");
+            return -EINVAL;
+        }
+        snprintf(g_aesd_pool_names[i], sizeof(g_aesd_pool_names[i]), "aesdchar-%u", pool_sizes[i]);
+        // The whole object is copied to and from user space
+        g_aesd_pool[i] = kmem_cache_create_usercopy(
+            g_aesd_pool_names[i], pool_sizes[i], 0, 0, 0, pool_sizes[i], NULL
+        );
+        if (g_aesd_pool[i] == NULL) {
+            printk(KERN_WARNING "Can't create %s cache\n", g_aesd_pool_names[i]);
+            return -ENOMEM;
+        }
+    }
+#else
+    // Entry data is freed with kvfree(), which only takes slab cache objects with every
+    // allocator since SLOB was removed
+    pool_classes = 0;
+#endif
+    return 0;
+}
+
+/**
+ * @brief   Destroy the slab caches created by aesd_pool_init(), once no entry data is left.
+ */
+static void aesd_pool_exit(void)
+{
+    for (int i = 0; i < AESD_POOL_CLASSES; i++) {
+        kmem_cache_destroy(g_aesd_pool[i]);
+        g_aesd_pool[i] = NULL;
+    }
+}
+
+/**
+ * @brief   Take @param lock of @param dev, counting whether it had to wait and for how long in
+ *          the counters of @param which.
+ * @param   interruptible Whether a signal can interrupt the wait.
+ * @return  0 once locked, or -ERESTARTSYS if interrupted.
+ */
+static int aesd_lock(
+    struct aesd_dev *dev, struct mutex *lock, enum aesd_lock which, bool interruptible
+) {
+    if (mutex_trylock(lock)) {
+        return 0;
+    }
+    trace_aesd_lock_wait_begin(dev, which);
+    u64 start = ktime_get_ns();
+    int result = 0;
+    if (interruptible) {
+        result = mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+    } else {
+        mutex_lock(lock);
+    }
+    u64 wait_ns = ktime_get_ns() - start;
+    this_cpu_inc(dev->stats->lock_contended[which]);
+    this_cpu_add(dev->stats->lock_wait_ns[which], wait_ns);
+    trace_aesd_lock_wait_end(dev, which, wait_ns, result);
+    return result;
+}
+
+/**
+ * @brief   Count a call of @param op on @param dev that returned @param result after
+ *          @param elapsed_ns.
+ */
+static void aesd_count_op(struct aesd_dev *dev, enum aesd_op op, ssize_t result, u64 elapsed_ns)
+{
+    this_cpu_inc(dev->stats->calls[op]);
+    if (result > 0) {
+        this_cpu_add(dev->stats->bytes[op], result);
+    }
+    unsigned int bucket = min_t(unsigned int, fls64(elapsed_ns), AESD_LATENCY_BUCKETS - 1);
+    this_cpu_inc(dev->stats->latency[op][bucket]);
+}
+
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    static const char *const op_names[AESD_OPS] = {"read", "write"};
+    static const char *const lock_names[AESD_LOCKS] = {"buf_lock", "entry_lock"};
+    struct aesd_dev *dev = s->private;
+    struct aesd_stats sum = {0};
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        const struct aesd_stats *stats = per_cpu_ptr(dev->stats, cpu);
+        for (int op = 0; op < AESD_OPS; op++) {
+            sum.calls[op] += stats->calls[op];
+            sum.bytes[op] += stats->bytes[op];
+            for (int i = 0; i < AESD_LATENCY_BUCKETS; i++) {
+                sum.latency[op][i] += stats->latency[op][i];
+            }
+        }
+        sum.records += stats->records;
+        sum.evictions += stats->evictions;
+        sum.pending_bytes += stats->pending_bytes;
+        for (int lock = 0; lock < AESD_LOCKS; lock++) {
+            sum.lock_contended[lock] += stats->lock_contended[lock];
+            sum.lock_wait_ns[lock] += stats->lock_wait_ns[lock];
+        }
+    }
+
+    unsigned int seq;
+    size_t entries;
+    size_t bytes;
+    do {
+        seq = read_seqcount_begin(&dev->buf_seq);
+        entries = aesd_circular_buffer_count(&dev->buf);
+        bytes = aesd_circular_buffer_size(&dev->buf);
+    } while (read_seqcount_retry(&dev->buf_seq, seq));
+    u64 unmerged = dev->shards != NULL
+        ? atomic64_read(&dev->shard_seq) - READ_ONCE(dev->entry_seq)
+        : 0;
+
+    for (int op = 0; op < AESD_OPS; op++) {
+        seq_printf(s, "%s_calls %lu\n", op_names[op], sum.calls[op]);
+        seq_printf(s, "%s_bytes %lu\n", op_names[op], sum.bytes[op]);
+    }
+    seq_printf(s, "records %lu\n", sum.records);
+    seq_printf(s, "evictions %lu\n", sum.evictions);
+    seq_printf(s, "entries %zu\n", entries);
+    seq_printf(s, "entry_bytes %zu\n", bytes);
+    seq_printf(s, "unmerged_entries %llu\n", unmerged);
+    seq_printf(s, "pending_bytes %ld\n", sum.pending_bytes);
+    for (int lock = 0; lock < AESD_LOCKS; lock++) {
+        seq_printf(s, "%s_contended %lu\n", lock_names[lock], sum.lock_contended[lock]);
+        seq_printf(s, "%s_wait_ns %llu\n", lock_names[lock], sum.lock_wait_ns[lock]);
+    }
+    // One line per bucket in use, with the bucket's upper bound in ns
+    for (int op = 0; op < AESD_OPS; op++) {
+        for (int i = 0; i < AESD_LATENCY_BUCKETS; i++) {
+            if (sum.latency[op][i] != 0) {
+                seq_printf(
+                    s, "%s_latency_ns %llu %lu\n", op_names[op], 1ULL << i, sum.latency[op][i]
+                );
+            }
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+/**
+ * @brief   Free the data of an entry dropped from the buffer.
+ *
+ * Entries stored in the arena need no freeing, dropping them from the buffer already advanced the
+ * arena tail past their data.
+ */
+static void aesd_free_entry_data(struct aesd_dev *dev, const char *data)
+{
+    if (dev->arena == NULL) {
+        kvfree(data);
+    }
+}
+
+/**
+ * @brief   Count @param count entries just dropped from the front of the buffer of @param dev,
+ *          which started at stream offset @param tail before. The caller must hold buf_lock.
+ */
+static void aesd_count_evictions(struct aesd_dev *dev, size_t count, size_t tail)
+{
+    if (count > 0) {
+        this_cpu_add(dev->stats->evictions, count);
+        trace_aesd_evict(dev, count, dev->buf.base_offs - tail, dev->buf.base_offs);
+    }
+}
+
+/**
+ * Data of entries dropped from the buffer in heap mode, waiting for an SRCU grace period
+ */
+struct aesd_reclaim
+{
+    struct rcu_head rcu;
+    size_t count;
+    const char *data[];
+};
+
+static void aesd_reclaim_free(struct rcu_head *rcu)
+{
+    struct aesd_reclaim *reclaim = container_of(rcu, struct aesd_reclaim, rcu);
+    for (size_t i = 0; i < reclaim->count; i++) {
+        kvfree(reclaim->data[i]);
+    }
+    kfree(reclaim);
+}
+
+/**
+ * @brief   Free the data of @param count entries dropped from the buffer, once no lockless reader
+ *          can still be copying from it. Must not be called within a write section of buf_seq.
+ */
+static void aesd_free_entries(struct aesd_dev *dev, const char *const *data, size_t count)
+{
+    if (dev->arena != NULL || count == 0) {
+        return;
+    }
+    struct aesd_reclaim *reclaim = kmalloc(struct_size(reclaim, data, count), GFP_KERNEL);
+    if (reclaim == NULL) {
+        // Wait out the readers here instead
+        synchronize_srcu(&dev->srcu);
+        for (size_t i = 0; i < count; i++) {
+            kvfree(data[i]);
+        }
+        return;
+    }
+    reclaim->count = count;
+    memcpy(reclaim->data, data, count * sizeof(*data));
+    call_srcu(&dev->srcu, &reclaim->rcu, aesd_reclaim_free);
+}
+
+/**
+ * @brief   Schedule expire_work for when the oldest entry of the buffer exceeds max_age. The
+ *          caller must hold buf_lock.
+ *
+ * @param   reschedule Replace an expiry that is already pending. Adding entries doesn't need to,
+ *              as a pending expiry is never later than the one it would be replaced with.
+ */
+static void aesd_schedule_expiry(struct aesd_dev *dev, bool reschedule)
+{
+    uint64_t expiry;
+    if (!aesd_circular_buffer_expiry(&dev->buf, &expiry)) {
+        // In sharded mode a writer may have just scheduled it for an entry still in its shard
+        if (reschedule && dev->shards == NULL) {
+            cancel_delayed_work(&dev->expire_work);
+        }
+        return;
+    }
+    u64 now = get_jiffies_64();
+    unsigned long delay = expiry > now ? (unsigned long)(expiry - now) : 0;
+    if (reschedule) {
+        mod_delayed_work(system_wq, &dev->expire_work, delay);
+    } else {
+        schedule_delayed_work(&dev->expire_work, delay);
+    }
+}
+
+/**
+ * @brief   Add @param count entries to the buffer, evicting whatever the retention policy requires.
+ *          The caller must hold buf_lock.
+ *
+ * Pointers to evicted data are returned in @param evicted so the caller can pass them to
+ * aesd_free_entries() after releasing buf_lock. If more than @param evicted_len entries are
+ * evicted, the excess is passed to it while still holding the lock.
+ *
+ * @return  The number of pointers stored in @param evicted.
+ */
+static size_t aesd_commit_entries(
+    struct aesd_dev *dev,
+    const struct aesd_buffer_entry *entries,
+    size_t count,
+    const char **evicted,
+    size_t evicted_len
+) {
+    size_t inserted = 0;
+    size_t before = aesd_circular_buffer_count(&dev->buf);
+    size_t tail = dev->buf.base_offs;
+    for (;;) {
+        size_t evicted_count = evicted_len;
+        write_seqcount_begin(&dev->buf_seq);
+        inserted += aesd_circular_buffer_add_entries(
+            &dev->buf, entries + inserted, count - inserted, evicted, &evicted_count
+        );
+        write_seqcount_end(&dev->buf_seq);
+        if (inserted == count) {
+            aesd_count_evictions(
+                dev, before + count - aesd_circular_buffer_count(&dev->buf), tail
+            );
+            aesd_schedule_expiry(dev, false);
+            return evicted_count;
+        }
+        PDEBUG("commit freeing %zu evicted entries under lock", evicted_count);
+        aesd_free_entries(dev, evicted, evicted_count);
+    }
+}
+
+/**
+ * @brief   Move the entries committed to the shards into the buffer in commit order, evicting
+ *          whatever the retention policy requires. The caller must hold buf_lock.
+ *
+ * Writers number entries and store them under the lock of their shard, so once every shard lock
+ * was taken after reading shard_seq, all entries numbered below it are in a shard, and each one
+ * can be placed in merge_entries by its number.
+ */
+static void aesd_merge_shards(struct aesd_dev *dev)
+{
+    if (dev->shards == NULL) {
+        return;
+    }
+    u64 first = dev->entry_seq;
+    u64 end = atomic64_read(&dev->shard_seq);
+    if (end == first) {
+        return;
+    }
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        struct aesd_shard *shard = per_cpu_ptr(dev->shards, cpu);
+        spin_lock(&shard->lock);
+        while (shard->count > 0 && shard->seq[shard->out] < end) {
+            dev->merge_entries[shard->seq[shard->out] - first] = shard->entry[shard->out];
+            shard->out = (shard->out + 1) & (AESD_SHARD_ENTRIES - 1);
+            shard->count--;
+        }
+        spin_unlock(&shard->lock);
+    }
+    PDEBUG("merge %llu entries from shards", end - first);
+
+    const char *evicted[AESD_EVICT_BATCH];
+    size_t evicted_count = aesd_commit_entries(
+        dev, dev->merge_entries, end - first, evicted, ARRAY_SIZE(evicted)
+    );
+    WRITE_ONCE(dev->entry_seq, end);
+    aesd_free_entries(dev, evicted, evicted_count);
+}
+
+/**
+ * @brief   Merge any entries waiting in the shards into the buffer, before reading it without
+ *          buf_lock.
+ * @return  0 on success, -ERESTARTSYS if interrupted while waiting for buf_lock.
+ */
+static int aesd_sync_shards(struct aesd_dev *dev)
+{
+    if (dev->shards == NULL || atomic64_read(&dev->shard_seq) == READ_ONCE(dev->entry_seq)) {
+        return 0;
+    }
+    if (aesd_lock(dev, &dev->buf_lock, AESD_LOCK_BUF, true)) {
+        return -ERESTARTSYS;
+    }
+    aesd_merge_shards(dev);
+    mutex_unlock(&dev->buf_lock);
+    return 0;
+}
+
+static void aesd_merge_work(struct work_struct *work)
+{
+    struct aesd_dev *dev = container_of(work, struct aesd_dev, merge_work);
+    aesd_lock(dev, &dev->buf_lock, AESD_LOCK_BUF, false);
+    aesd_merge_shards(dev);
+    mutex_unlock(&dev->buf_lock);
+}
+
+/**
+ * @return  The number of entries committed to the device, changing whenever readers waiting for
+ *          new entries should look again.
+ */
+static u64 aesd_committed(struct aesd_dev *dev)
+{
+    return dev->shards != NULL ? atomic64_read(&dev->shard_seq) : READ_ONCE(dev->entry_seq);
+}
+
+/**
+ * @return  The stream offset one past the last committed byte, which is where the next entry
+ *          goes in the arena. The caller must hold buf_lock.
+ */
+static size_t aesd_stream_head(struct aesd_dev *dev)
+{
+    return dev->buf.base_offs + aesd_circular_buffer_size(&dev->buf);
+}
+
+/**
+ * @brief   Copy the index of the buffer to @param snap without taking buf_lock, for looking up
+ *          entries with the aesd_buffer_index functions.
+ *
+ * The entry slots aren't copied, snap->entry still points at the ones in use by the buffer. The
+ * caller must be in an SRCU read section of dev->srcu to keep them allocated, and must check
+ * anything read from them with read_seqcount_retry() against the returned sequence number, as
+ * writers keep changing them.
+ *
+ * @return  The sequence number of buf_seq that @param snap is consistent with.
+ */
+static unsigned int aesd_buf_snapshot(struct aesd_dev *dev, struct aesd_buffer_index *snap)
+{
+    unsigned int seq;
+    do {
+        seq = read_seqcount_begin(&dev->buf_seq);
+        *snap = dev->buf.index;
+    } while (read_seqcount_retry(&dev->buf_seq, seq));
+    return seq;
+}
+
+/**
+ * @return  The total number of bytes in the buffer, read without taking buf_lock.
+ */
+static size_t aesd_history_size(struct aesd_dev *dev)
+{
+    unsigned int seq;
+    size_t size;
+    do {
+        seq = read_seqcount_begin(&dev->buf_seq);
+        size = aesd_circular_buffer_size(&dev->buf);
+    } while (read_seqcount_retry(&dev->buf_seq, seq));
+    return size;
+}
+
+/**
+ * @brief   Update the mmap header to match the buffer after it changed, describing the last
+ *          @param added entries as new. entry_seq must already count them. The caller must hold
+ *          buf_lock.
+ */
+static void aesd_mmap_publish(struct aesd_dev *dev, size_t added)
+{
+    struct aesd_mmap_header *header = dev->mmap_header;
+    if (header == NULL) {
+        return;
+    }
+    size_t count = aesd_circular_buffer_count(&dev->buf);
+    size_t described = min_t(size_t, count, header->entries_len);
+    u64 mask = header->entries_len - 1;
+
+    // Make the generation odd before touching anything a consumer may be reading
+    WRITE_ONCE(header->generation, header->generation + 1);
+    smp_wmb();
+    for (size_t i = count - min(added, described); i < count; i++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry_at_out_index(
+            &dev->buf, i
+        );
+        struct aesd_mmap_entry *slot = &header->entries[(dev->entry_seq - count + i) & mask];
+        slot->offs = entry->stream_offs;
+        slot->size = entry->size;
+    }
+    header->tail = dev->buf.base_offs;
+    header->head = aesd_stream_head(dev);
+    header->tail_seq = dev->entry_seq - described;
+    header->head_seq = dev->entry_seq;
+    smp_wmb();
+    WRITE_ONCE(header->generation, header->generation + 1);
+}
+
+/**
+ * @brief   Drop every entry the retention policy no longer allows at the current time, a batch at
+ *          a time, then schedule expire_work for the next entry to expire. The caller must hold
+ *          buf_lock.
+ */
+static void aesd_trim_entries(struct aesd_dev *dev)
+{
+    u64 now = get_jiffies_64();
+    size_t evicted_count;
+    do {
+        const char *evicted[AESD_EVICT_BATCH];
+        struct aesd_buffer_entry entry;
+        evicted_count = 0;
+        size_t tail = dev->buf.base_offs;
+        write_seqcount_begin(&dev->buf_seq);
+        while (
+            evicted_count < ARRAY_SIZE(evicted)
+                && aesd_circular_buffer_evict_entry(&dev->buf, NULL, now, &entry)
+        ) {
+            evicted[evicted_count++] = entry.buffptr;
+        }
+        write_seqcount_end(&dev->buf_seq);
+        aesd_count_evictions(dev, evicted_count, tail);
+        aesd_free_entries(dev, evicted, evicted_count);
+    } while (evicted_count == AESD_EVICT_BATCH);
+    aesd_mmap_publish(dev, 0);
+    aesd_schedule_expiry(dev, true);
+}
+
+/**
+ * Drops entries once they exceed max_age, so an idle device doesn't keep returning them or hold
+ * on to their memory until the next write
+ */
+static void aesd_expire_work(struct work_struct *work)
+{
+    struct aesd_dev *dev = container_of(to_delayed_work(work), struct aesd_dev, expire_work);
+    aesd_lock(dev, &dev->buf_lock, AESD_LOCK_BUF, false);
+    aesd_merge_shards(dev);
+    aesd_trim_entries(dev);
+    mutex_unlock(&dev->buf_lock);
+}
+
+/**
+ * @brief   Copy @param count bytes starting at stream offset @param pos from the arena to
+ *          @param to, splitting the copy at the wrap point of the ring.
+ *
+ * @return  The number of bytes copied, less than @param count on a fault.
+ */
+static size_t aesd_arena_copy_to_iter(
+    struct aesd_dev *dev, struct iov_iter *to, size_t pos, size_t count
+) {
+    size_t offs = pos & dev->arena_mask;
+    size_t first = min(count, dev->arena_mask + 1 - offs);
+    size_t copied = copy_to_iter(dev->arena + offs, first, to);
+    if (copied == first && first < count) {
+        copied += copy_to_iter(dev->arena, count - first, to);
+    }
+    return copied;
+}
+
+/**
+ * @brief   Copy @param count bytes from @param src into the arena starting at stream offset
+ *          @param pos, splitting the copy at the wrap point of the ring.
+ */
+static void aesd_arena_copy_in(struct aesd_dev *dev, size_t pos, const char *src, size_t count)
+{
+    size_t offs = pos & dev->arena_mask;
+    size_t first = min(count, dev->arena_mask + 1 - offs);
+    memcpy(dev->arena + offs, src, first);
+    memcpy(dev->arena, src + first, count - first);
+}
+
+/**
+ * @brief   Free @param ref's device once the device table and every open file have let go of it.
+ */
+static void aesd_free_device(struct kref *ref);
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
-    PDEBUG("open");
-    struct aesd_dev *dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = dev;
+    struct aesd_file *file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (file == NULL) {
+        return -ENOMEM;
+    }
+    // The instance may have been destroyed since the open found its cdev
+    unsigned int index = iminor(inode) - g_aesd_minor;
+    mutex_lock(&g_aesd_devices_lock);
+    if (index < AESD_MAX_INSTANCES && g_aesd_devices[index] != NULL) {
+        file->dev = g_aesd_devices[index];
+        kref_get(&file->dev->ref);
+    }
+    mutex_unlock(&g_aesd_devices_lock);
+    if (file->dev == NULL) {
+        kfree(file);
+        return -ENODEV;
+    }
+    mutex_init(&file->entry_lock);
+    filp->private_data = file;
+    trace_aesd_open(file->dev, filp->f_flags);
+    return 0;
+}
+
+int aesd_fasync(int fd, struct file *filp, int on)
+{
+    PDEBUG("fasync %s", on ? "on" : "off");
+    struct aesd_file *file = filp->private_data;
+    return fasync_helper(fd, filp, on, &file->dev->async_queue);
+}
+
+/**
+ * @brief   Commit the incomplete line left pending in @param file as an entry of its own, so its
+ *          bytes still reach the history once the file is closed.
+ */
+static void aesd_flush_entry(struct aesd_file *file);
+
+int aesd_release(struct inode *inode, struct file *filp)
+{
+    PDEBUG("release");
+    struct aesd_file *file = filp->private_data;
+    aesd_fasync(-1, filp, 0);
+    if (file->entry.size > 0) {
+        this_cpu_sub(file->dev->stats->pending_bytes, file->entry.size);
+        aesd_flush_entry(file);
+    }
+    kvfree(file->entry.buffptr);
+    kref_put(&file->dev->ref, aesd_free_device);
+    kfree(file);
+    return 0;
+}
+
+loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
+{
+    struct aesd_file *file = filp->private_data;
+    loff_t result = -ERESTARTSYS;
+    if (aesd_sync_shards(file->dev) == 0) {
+        result = fixed_size_llseek(filp, offset, whence, aesd_history_size(file->dev));
+        WRITE_ONCE(file->at_eof, false);
+    }
+    trace_aesd_llseek(file->dev, offset, whence, result);
+    return result;
+}
+
+/**
+ * @brief   Check for data to read on @param file at @param f_pos, recording where the data ended
+ *          if there is none. The caller must hold buf_lock.
+ *
+ * Evictions shift every file position back, so once more data is committed after a read found
+ * the end of data, @param f_pos is moved to where that data starts. Otherwise a reader at the end
+ * of a full buffer would never see new entries.
+ *
+ * @return  true if there is data at @param f_pos.
+ */
+static bool aesd_resume_read(struct aesd_file *file, loff_t *f_pos)
+{
+    struct aesd_dev *dev = file->dev;
+    size_t head = aesd_stream_head(dev);
+    if (file->at_eof && *f_pos == file->eof_fpos && head != file->eof_offs) {
+        PDEBUG("read resuming at stream offset %zu", file->eof_offs);
+        *f_pos = file->eof_offs > dev->buf.base_offs ? file->eof_offs - dev->buf.base_offs : 0;
+        file->at_eof = false;
+    }
+    if (*f_pos < aesd_circular_buffer_size(&dev->buf)) {
+        return true;
+    }
+    file->at_eof = true;
+    file->eof_fpos = *f_pos;
+    file->eof_offs = head;
+    return false;
+}
+
+/**
+ * @brief   Copy the history starting at @param f_pos to @param to without taking buf_lock.
+ *
+ * The buffer is looked up under the buf_seq seqcount. In heap mode the data found stays
+ * allocated until the SRCU read section ends, and the lookup starts from the cursor of
+ * @param file, so sequential reads don't search the buffer. The arena is only overwritten after
+ * its data was evicted, so a copy from it is checked against the tail afterwards and redone if
+ * it raced.
+ *
+ * @return  The number of bytes copied, 0 if there is no data at @param f_pos, or -EFAULT.
+ */
+static ssize_t aesd_read_history(struct aesd_file *file, struct iov_iter *to, loff_t *f_pos)
+{
+    struct aesd_dev *dev = file->dev;
+    struct aesd_buffer_cursor cursor = file->cursor;
+    size_t count = iov_iter_count(to);
+    size_t read_count = 0;
+    // Stream offset of the next byte to copy
+    size_t pos = 0;
+    bool fault = false;
+    int idx = srcu_read_lock(&dev->srcu);
+    while (read_count < count && !fault) {
+        struct aesd_buffer_index snap;
+        unsigned int seq = aesd_buf_snapshot(dev, &snap);
+        if (read_count == 0) {
+            pos = snap.base_offs + *f_pos;
+        } else if (pos < snap.base_offs) {
+            PDEBUG("read rest of data evicted");
+            break;
+        }
+        size_t offs = pos - snap.base_offs;
+        size_t total_size = snap.total_size;
+        if (offs >= total_size) {
+            break;
+        }
+
+        size_t copied = 0;
+        if (dev->arena != NULL) {
+            // The history is contiguous in the arena, so copy as much as fits in at most two parts
+            size_t len = min(count - read_count, total_size - offs);
+            PDEBUG("read copying %zu bytes from arena to user buf", len);
+            copied = aesd_arena_copy_to_iter(dev, to, pos, len);
+            fault = copied < len;
+            if (read_seqcount_retry(&dev->buf_seq, seq)) {
+                aesd_buf_snapshot(dev, &snap);
+                if (snap.base_offs > pos) {
+                    PDEBUG("read raced with eviction");
+                    iov_iter_revert(to, copied);
+                    fault = false;
+                    continue;
+                }
+            }
+        } else {
+            // Copy from as many consecutive entries as fit in the user buffers, a batch of entries
+            // at a time, so a whole history dump takes one call
+            struct kvec iov[AESD_READ_IOVECS];
+            size_t bytes = 0;
+            size_t iov_count = aesd_buffer_index_fill_iovec_cursor(
+                &snap, &cursor, offs, count - read_count, iov, ARRAY_SIZE(iov), &bytes
+            );
+            if (read_seqcount_retry(&dev->buf_seq, seq)) {
+                PDEBUG("read raced with write");
+                continue;
+            }
+            for (size_t i = 0; i < iov_count && !fault; i++) {
+                PDEBUG("read copying %zu bytes to user buf", iov[i].iov_len);
+                size_t n = copy_to_iter(iov[i].iov_base, iov[i].iov_len, to);
+                copied += n;
+                fault = n < iov[i].iov_len;
+            }
+        }
+        read_count += copied;
+        pos += copied;
+    }
+    srcu_read_unlock(&dev->srcu, idx);
+    file->cursor = cursor;
+
+    if (read_count == 0) {
+        // Report a fault only if nothing was copied before it
+        return fault ? -EFAULT : 0;
+    }
+    *f_pos += read_count;
+    return read_count;
+}
+
+static ssize_t aesd_do_read(struct kiocb *iocb, struct iov_iter *to)
+{
+    ssize_t result = 0;
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    loff_t *f_pos = &iocb->ki_pos;
+
+    if (iov_iter_count(to) == 0) {
+        return 0;
+    }
+
+    for (;;) {
+        if (aesd_sync_shards(dev)) {
+            return -ERESTARTSYS;
+        }
+        // Only a read at the end of data needs buf_lock, to resume after data committed since
+        // the last read or wait for more
+        if (!READ_ONCE(file->at_eof) || *f_pos != READ_ONCE(file->eof_fpos)) {
+            result = aesd_read_history(file, to, f_pos);
+            if (result != 0) {
+                return result;
+            }
+        }
+
+        if (aesd_lock(dev, &dev->buf_lock, AESD_LOCK_BUF, true)) {
+            return -ERESTARTSYS;
+        }
+        for (;;) {
+            // Read the count before merging, so an entry committed to a shard after the merge
+            // changes it and isn't waited past
+            u64 seq = aesd_committed(dev);
+            aesd_merge_shards(dev);
+            if (aesd_resume_read(file, f_pos)) {
+                break;
+            }
+            if (!follow) {
+                PDEBUG("read end of file");
+                result = 0;
+                goto out;
+            }
+            if (iocb->ki_filp->f_flags & O_NONBLOCK) {
+                PDEBUG("read would block");
+                result = -EAGAIN;
+                goto out;
+            }
+            // Sleep until another entry is committed, then resume where the data ended
+            mutex_unlock(&dev->buf_lock);
+            PDEBUG("read waiting for data");
+            if (wait_event_interruptible(dev->wait, aesd_committed(dev) != seq)) {
+                return -ERESTARTSYS;
+            }
+            if (aesd_lock(dev, &dev->buf_lock, AESD_LOCK_BUF, true)) {
+                return -ERESTARTSYS;
+            }
+        }
+        mutex_unlock(&dev->buf_lock);
+    }
+
+out:
+    mutex_unlock(&dev->buf_lock);
+    return result;
+}
+
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    u64 start = ktime_get_ns();
+    ssize_t result = aesd_do_read(iocb, to);
+    aesd_count_op(file->dev, AESD_OP_READ, result, ktime_get_ns() - start);
+    trace_aesd_read(file->dev, pos, count, result);
+    return result;
+}
+
+/**
+ * @brief   Move the first @param used bytes of the pending entry of @param file to a new
+ *          allocation of @param capacity bytes.
+ *
+ * @return  0 on success, -ENOMEM on failure. The pending entry is unchanged on failure.
+ */
+static int aesd_realloc_entry(struct aesd_file *file, size_t used, size_t capacity)
+{
+    char *kbuf = aesd_data_alloc(capacity, &capacity);
+    if (kbuf == NULL) {
+        return -ENOMEM;
+    }
+    if (file->entry.buffptr != NULL) {
+        memcpy(kbuf, file->entry.buffptr, used);
+        kvfree(file->entry.buffptr);
+    }
+    file->entry.buffptr = kbuf;
+    file->entry_capacity = capacity;
     return 0;
 }
 
-int aesd_release(struct inode *inode, struct file *filp)
+/**
+ * @brief   Release any large growth slack of the pending entry of @param file before it's handed
+ *          to the buffer, best effort.
+ */
+static void aesd_trim_entry(struct aesd_file *file)
+{
+    size_t size = file->entry.size;
+    if (aesd_data_capacity(size) < file->entry_capacity && file->entry_capacity - size > size / 4) {
+        PDEBUG("write trim entry to %zu bytes", size);
+        aesd_realloc_entry(file, size, size);
+    }
+}
+
+/**
+ * @brief   Append user data to the pending entry of @param file, growing it to fit.
+ *
+ * The allocation grows geometrically so a record built from many small writes copies each byte
+ * a constant number of times on average. Common record sizes come from the slab caches of
+ * aesd_data_alloc(), multi-megabyte records from kvmalloc() so they don't depend on finding
+ * contiguous pages. aesd_trim_entry() releases any large growth slack once the record is
+ * complete.
+ *
+ * @return  0 on success, negative error code on failure. The data of the pending entry is
+ *          unchanged on failure.
+ */
+static int aesd_append_entry(struct aesd_file *file, struct iov_iter *from, size_t count)
+{
+    size_t size = file->entry.size + count;
+    if (size > file->entry_capacity) {
+        // The first write of a record is allocated exactly, most records are a single write
+        size_t capacity = file->entry_capacity == 0 ? size : max(size, 2 * file->entry_capacity);
+        PDEBUG("write grow entry to %zu bytes", capacity);
+        if (aesd_realloc_entry(file, file->entry.size, capacity)) {
+            return -ENOMEM;
+        }
+    }
+    if (copy_from_iter((char *)file->entry.buffptr + file->entry.size, count, from) != count) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+/**
+ * @return  The index of the next newline in the pending entry of @param file at or after byte
+ *          @param from, or entry.size if there is none.
+ */
+static size_t aesd_find_newline(struct aesd_file *file, size_t from)
+{
+    size_t size = file->entry.size;
+    if (from >= size) {
+        return size;
+    }
+    const char *nl = memchr(file->entry.buffptr + from, '\n', size - from);
+    return nl != NULL ? nl - file->entry.buffptr : size;
+}
+
+/**
+ * @return  The number of complete lines in the pending entry of @param file, searching from byte
+ *          @param from. The bytes before it must not contain a newline.
+ */
+static size_t aesd_count_lines(struct aesd_file *file, size_t from)
+{
+    size_t lines = 0;
+    for (
+        size_t i = aesd_find_newline(file, from);
+        i < file->entry.size;
+        i = aesd_find_newline(file, i + 1)
+    ) {
+        lines++;
+    }
+    return lines;
+}
+
+/**
+ * @brief   Describe the @param lines complete lines at the front of the pending entry of
+ *          @param file in @param entries, without taking buf_lock.
+ *
+ * In heap mode each line is copied to an allocation of its own, except that a pending entry
+ * holding exactly one line is used as is. In arena mode only the sizes are set, the data is
+ * copied to the arena by aesd_push_entries(). The pending entry keeps the lines until
+ * aesd_consume_lines(), or aesd_drop_lines() if they aren't committed after all.
+ *
+ * @param   from Byte of the pending entry to search for newlines from, see aesd_count_lines().
+ * @param   len_rtn Location to store the number of bytes the lines cover.
+ *
+ * @return  0 on success, -ENOMEM on failure.
+ */
+static int aesd_split_lines(
+    struct aesd_file *file,
+    size_t from,
+    struct aesd_buffer_entry *entries,
+    size_t lines,
+    size_t *len_rtn
+) {
+    bool heap = file->dev->arena == NULL;
+    size_t start = 0;
+    for (size_t i = 0; i < lines; i++) {
+        size_t end = aesd_find_newline(file, max(start, from)) + 1;
+        entries[i].size = end - start;
+        entries[i].buffptr = NULL;
+        if (heap && end - start == file->entry.size) {
+            aesd_trim_entry(file);
+            entries[i].buffptr = file->entry.buffptr;
+        } else if (heap) {
+            size_t capacity;
+            char *kbuf = aesd_data_alloc(end - start, &capacity);
+            if (kbuf == NULL) {
+                while (i-- > 0) {
+                    kvfree(entries[i].buffptr);
+                }
+                return -ENOMEM;
+            }
+            memcpy(kbuf, file->entry.buffptr + start, end - start);
+            entries[i].buffptr = kbuf;
+        }
+        start = end;
+    }
+    *len_rtn = start;
+    return 0;
+}
+
+/**
+ * @return  true if each of the @param lines lines described by @param entries fits in the arena,
+ *          and so does the incomplete line left in the pending entry after the @param len bytes
+ *          they cover.
+ */
+static bool aesd_lines_fit_arena(
+    struct aesd_file *file, const struct aesd_buffer_entry *entries, size_t lines, size_t len
+) {
+    size_t capacity = file->dev->arena_mask + 1;
+    for (size_t i = 0; i < lines; i++) {
+        if (entries[i].size > capacity) {
+            return false;
+        }
+    }
+    return file->entry.size - len <= capacity;
+}
+
+/**
+ * @return  The number of lines from the front of the @param lines described by @param entries
+ *          that can be committed together, at least one, storing the bytes they cover in
+ *          @param len_rtn. In arena mode they must fit in the arena together.
+ */
+static size_t aesd_group_lines(
+    struct aesd_dev *dev, const struct aesd_buffer_entry *entries, size_t lines, size_t *len_rtn
+) {
+    size_t len = entries[0].size;
+    size_t group = 1;
+    while (
+        group < lines && (dev->arena == NULL || len + entries[group].size <= dev->arena_mask + 1)
+    ) {
+        len += entries[group++].size;
+    }
+    *len_rtn = len;
+    return group;
+}
+
+/**
+ * @brief   Free the copies aesd_split_lines() made of @param lines lines that won't be committed.
+ */
+static void aesd_drop_lines(
+    struct aesd_file *file, struct aesd_buffer_entry *entries, size_t lines
+) {
+    for (size_t i = 0; i < lines; i++) {
+        if (entries[i].buffptr != file->entry.buffptr) {
+            kvfree(entries[i].buffptr);
+        }
+    }
+}
+
+/**
+ * @brief   Remove the first @param len bytes, committed as @param lines entries, from the pending
+ *          entry of @param file, keeping only the incomplete tail.
+ */
+static void aesd_consume_lines(struct aesd_file *file, size_t len, size_t lines)
+{
+    file->entry.size -= len;
+    if (file->entry.size > 0) {
+        memmove((char *)file->entry.buffptr, file->entry.buffptr + len, file->entry.size);
+    } else if (file->dev->arena == NULL) {
+        // A single line took over the allocation, otherwise the lines were copied out of it
+        if (lines > 1) {
+            kvfree(file->entry.buffptr);
+        }
+        file->entry.buffptr = NULL;
+        file->entry_capacity = 0;
+    }
+}
+
+/**
+ * @brief   Copy the first @param len bytes of the pending entry of @param file to the arena right
+ *          after the committed entries, dropping the oldest entries to make room, and point the
+ *          entries covering them at the copy. The caller must hold buf_lock.
+ */
+static void aesd_arena_place(
+    struct aesd_file *file, struct aesd_buffer_entry *entries, size_t count, size_t len
+) {
+    struct aesd_dev *dev = file->dev;
+    size_t capacity = dev->arena_mask + 1;
+    struct aesd_buffer_entry evicted;
+    size_t evicted_count = 0;
+    size_t tail = dev->buf.base_offs;
+    write_seqcount_begin(&dev->buf_seq);
+    while (aesd_circular_buffer_size(&dev->buf) + len > capacity) {
+        aesd_circular_buffer_remove_entry(&dev->buf, &evicted);
+        evicted_count++;
+    }
+    write_seqcount_end(&dev->buf_seq);
+    aesd_count_evictions(dev, evicted_count, tail);
+    // Consumers of the mapping must see the dropped data go before it's overwritten
+    aesd_mmap_publish(dev, 0);
+    // Lockless readers check the tail after copying, order it before the data overwriting theirs
+    smp_wmb();
+
+    size_t pos = aesd_stream_head(dev);
+    aesd_arena_copy_in(dev, pos, file->entry.buffptr, len);
+    for (size_t i = 0; i < count; i++) {
+        entries[i].buffptr = dev->arena + (pos & dev->arena_mask);
+        pos += entries[i].size;
+    }
+}
+
+/**
+ * @brief   Let readers waiting in read() or poll(), and processes signalled with SIGIO, know about
+ *          new entries.
+ *
+ * Neither touches state shared between CPUs unless someone is waiting, so writers to different
+ * shards don't contend here. wq_has_sleeper() pairs with the barrier taken by a waiter between
+ * adding itself to the queue and checking for new entries.
+ */
+static void aesd_notify_readers(struct aesd_dev *dev)
+{
+    if (wq_has_sleeper(&dev->wait)) {
+        wake_up_interruptible(&dev->wait);
+    }
+    // Returns without locking when no process asked for SIGIO
+    kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+}
+
+/**
+ * @brief   Commit @param count entries covering the first @param len bytes of the pending entry
+ *          of @param file to the buffer, then release buf_lock, which the caller must hold.
+ */
+static void aesd_push_entries(
+    struct aesd_file *file, struct aesd_buffer_entry *entries, size_t count, size_t len
+) {
+    struct aesd_dev *dev = file->dev;
+    // Data evicted by the commit, freed once buf_lock is released
+    const char *evicted[AESD_EVICT_BATCH];
+
+    if (dev->arena != NULL) {
+        aesd_arena_place(file, entries, count, len);
+    }
+    u64 stamp = get_jiffies_64();
+    for (size_t i = 0; i < count; i++) {
+        entries[i].stamp = stamp;
+    }
+    trace_aesd_commit(dev, dev->entry_seq, count, len);
+    size_t evicted_count = aesd_commit_entries(dev, entries, count, evicted, ARRAY_SIZE(evicted));
+    WRITE_ONCE(dev->entry_seq, dev->entry_seq + count);
+    this_cpu_add(dev->stats->records, count);
+    aesd_mmap_publish(dev, count);
+    mutex_unlock(&dev->buf_lock);
+
+    aesd_notify_readers(dev);
+
+    // Clean up old entry data dropped from the buffer by the retention policy
+    aesd_free_entries(dev, evicted, evicted_count);
+}
+
+/**
+ * @brief   Schedule expire_work for when an entry just committed to an empty shard exceeds
+ *          max_age, so it is merged and expired even if nothing else merges the shards.
+ *
+ * Later entries of the same shard expire after it, and are merged along with it. An expiry
+ * already pending is for an older entry, so it is left alone.
+ */
+static void aesd_schedule_shard_expiry(struct aesd_dev *dev)
+{
+    u64 max_age = READ_ONCE(dev->buf.max_age);
+    if (max_age != 0) {
+        schedule_delayed_work(&dev->expire_work, (unsigned long)max_age + 1);
+    }
+}
+
+/**
+ * @brief   Commit @param count entries to the shard of the current CPU without taking buf_lock, in
+ *          sharded mode.
+ *
+ * A writer that fills its shard merges the shards itself before going on, a shard more than half
+ * full is left to merge_work.
+ */
+static void aesd_shard_entries(
+    struct aesd_dev *dev, const struct aesd_buffer_entry *entries, size_t count
+) {
+    size_t done = 0;
+    while (done < count) {
+        // Moving to another CPU after picking the shard only costs locality, its lock keeps it safe
+        struct aesd_shard *shard = raw_cpu_ptr(dev->shards);
+        spin_lock(&shard->lock);
+        size_t n = min_t(size_t, count - done, AESD_SHARD_ENTRIES - shard->count);
+        u64 seq = atomic64_add_return(n, &dev->shard_seq) - n;
+        u64 stamp = get_jiffies_64();
+        size_t bytes = 0;
+        unsigned int before = shard->count;
+        for (size_t i = 0; i < n; i++) {
+            unsigned int slot = (shard->out + shard->count++) & (AESD_SHARD_ENTRIES - 1);
+            shard->entry[slot] = entries[done + i];
+            shard->entry[slot].stamp = stamp;
+            shard->seq[slot] = seq + i;
+            bytes += entries[done + i].size;
+        }
+        // Only the write taking the shard past half full schedules the merge, which empties it
+        bool half_full = before <= AESD_SHARD_ENTRIES / 2 && shard->count > AESD_SHARD_ENTRIES / 2;
+        spin_unlock(&shard->lock);
+        if (before == 0) {
+            aesd_schedule_shard_expiry(dev);
+        }
+        this_cpu_add(dev->stats->records, n);
+        trace_aesd_commit(dev, seq, n, bytes);
+        done += n;
+        if (done < count) {
+            PDEBUG("write merging full shard");
+            aesd_lock(dev, &dev->buf_lock, AESD_LOCK_BUF, false);
+            aesd_merge_shards(dev);
+            mutex_unlock(&dev->buf_lock);
+        } else if (half_full) {
+            schedule_work(&dev->merge_work);
+        }
+    }
+
+    // Waiting readers merge the new entries when they look
+    aesd_notify_readers(dev);
+}
+
+static void aesd_flush_entry(struct aesd_file *file)
+{
+    struct aesd_dev *dev = file->dev;
+    PDEBUG("release flush %zu pending bytes", file->entry.size);
+    if (dev->arena == NULL) {
+        aesd_trim_entry(file);
+    }
+    struct aesd_buffer_entry entry = {.buffptr = file->entry.buffptr, .size = file->entry.size};
+    if (dev->shards != NULL) {
+        aesd_shard_entries(dev, &entry, 1);
+    } else {
+        // Closing can't be interrupted, a process killed mid-line still gets its data in
+        aesd_lock(dev, &dev->buf_lock, AESD_LOCK_BUF, false);
+        aesd_push_entries(file, &entry, 1, entry.size);
+    }
+    aesd_consume_lines(file, entry.size, 1);
+}
+
+static ssize_t aesd_do_write(struct kiocb *iocb, struct iov_iter *from)
+{
+    ssize_t result = 0;
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    size_t count = iov_iter_count(from);
+    loff_t *f_pos = &iocb->ki_pos;
+
+    // Entries for the lines completed by this write, allocated if there are too many
+    struct aesd_buffer_entry line_entries[AESD_WRITE_LINES];
+    struct aesd_buffer_entry *entries = line_entries;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    // Every file stages its own pending entry, so this only waits for writes through this file
+    if (aesd_lock(dev, &file->entry_lock, AESD_LOCK_ENTRY, true)) {
+        return -ERESTARTSYS;
+    }
+    size_t pending = file->entry.size;
+
+    // Append the data from every user buffer to the pending entry, so a writev() of several
+    // records commits them all under a single buf_lock hold
+    result = aesd_append_entry(file, from, count);
+    if (result) {
+        goto out;
+    }
+    size_t scan_from = file->entry.size;
+    file->entry.size += count;
+
+    // Push every complete line as an entry of its own, only the commit needs buf_lock or a shard
+    size_t lines = aesd_count_lines(file, scan_from);
+    size_t len = 0;
+    if (lines > ARRAY_SIZE(line_entries)) {
+        entries = kvmalloc_array(lines, sizeof(*entries), GFP_KERNEL);
+    }
+    if (lines > 0 && (entries == NULL || aesd_split_lines(file, scan_from, entries, lines, &len))) {
+        // Drop the new data so the write has no effect
+        file->entry.size = scan_from;
+        result = -ENOMEM;
+        goto out;
+    }
+    if (dev->arena != NULL && !aesd_lines_fit_arena(file, entries, lines, len)) {
+        PDEBUG("write line larger than arena");
+        // Nothing was allocated for the lines in arena mode
+        file->entry.size = scan_from;
+        result = -EFBIG;
+        goto out;
+    }
+    if (dev->shards != NULL) {
+        if (lines > 0) {
+            aesd_shard_entries(dev, entries, lines);
+            aesd_consume_lines(file, len, lines);
+        }
+    } else {
+        // Lines covering more than the arena are committed a group at a time. Only the wait for
+        // the first group can be interrupted, so the write still commits all its lines or none.
+        for (size_t done = 0; done < lines;) {
+            size_t group_len;
+            size_t group = aesd_group_lines(dev, entries + done, lines - done, &group_len);
+            if (aesd_lock(dev, &dev->buf_lock, AESD_LOCK_BUF, done == 0)) {
+                aesd_drop_lines(file, entries, lines);
+                file->entry.size = scan_from;
+                result = -ERESTARTSYS;
+                goto out;
+            }
+            aesd_push_entries(file, entries + done, group, group_len);
+            aesd_consume_lines(file, group_len, group);
+            done += group;
+        }
+    }
+    result = count;
+    *f_pos += count;
+
+out:
+    if (entries != line_entries) {
+        kvfree(entries);
+    }
+    this_cpu_add(dev->stats->pending_bytes, (long)file->entry.size - (long)pending);
+    mutex_unlock(&file->entry_lock);
+    return result;
+}
+
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    PDEBUG("release");
-    /**
-     * TODO: handle release
-     */
-    return 0;
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    u64 start = ktime_get_ns();
+    ssize_t result = aesd_do_write(iocb, from);
+    aesd_count_op(file->dev, AESD_OP_WRITE, result, ktime_get_ns() - start);
+    trace_aesd_write(file->dev, pos, count, result);
+    return result;
 }
 
-loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
+long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd, uint32_t write_cmd_offset)
 {
-    const char *directive = "UNKNOWN";
-    switch (whence) {
-        case SEEK_SET: directive = "SEEK_SET"; break;
-        case SEEK_CUR: directive = "SEEK_CUR"; break;
-        case SEEK_END: directive = "SEEK_END"; break;
-        default: break;
-    }
-    PDEBUG("llseek with offset %lld and directive %s", offset, directive);
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    long result = 0;
 
-    struct aesd_dev *dev = filp->private_data;
-    if (mutex_lock_interruptible(&dev->buf_lock)) {
-        PDEBUG("llseek lock interrupted");
-        return -ERESTARTSYS;
+    // Simple bounds check that doesn't require looking at the buffer
+    if (write_cmd >= AESDCHAR_MAX_DEPTH) {
+        PDEBUG("write_cmd %u greater than max %u", write_cmd, AESDCHAR_MAX_DEPTH);
+        result = -EINVAL;
+        goto out;
     }
-    size_t total_size = 0;
-    int i = 0;
-    struct aesd_buffer_entry *entry = NULL;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &g_aesd_device.buf, i) {
-        total_size += entry->size;
+    if (aesd_sync_shards(dev)) {
+        result = -ERESTARTSYS;
+        goto out;
     }
-    loff_t result = fixed_size_llseek(filp, offset, whence, total_size);
-    mutex_unlock(&dev->buf_lock);
+    // Look up the write command without taking buf_lock, its start offset is cached by the
+    // circular buffer
+    struct aesd_buffer_index snap;
+    bool found;
+    size_t entry_size = 0;
+    loff_t f_pos = 0;
+    unsigned int seq;
+    int idx = srcu_read_lock(&dev->srcu);
+    do {
+        seq = aesd_buf_snapshot(dev, &snap);
+        struct aesd_buffer_entry *entry = aesd_buffer_index_get_entry_at_out_index(
+            &snap, write_cmd
+        );
+        found = entry != NULL;
+        if (found) {
+            entry_size = entry->size;
+            f_pos = aesd_buffer_index_entry_fpos(&snap, entry);
+        }
+    } while (read_seqcount_retry(&dev->buf_seq, seq));
+    srcu_read_unlock(&dev->srcu, idx);
+    if (!found) {
+        PDEBUG("no write_cmd found at index %u", write_cmd);
+        result = -EINVAL;
+        goto out;
+    }
+    if (write_cmd_offset >= entry_size) {
+        PDEBUG("write_cmd_offset %u greater than entry size %zu", write_cmd_offset, entry_size);
+        result = -EINVAL;
+        goto out;
+    }
+    f_pos += write_cmd_offset;
+    // Overwrite f_pos
+    filp->f_pos = f_pos;
+    WRITE_ONCE(file->at_eof, false);
+out:
+    trace_aesd_seekto(dev, write_cmd, write_cmd_offset, filp->f_pos, result);
     return result;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+long aesd_set_depth(struct aesd_dev *dev, uint32_t new_depth)
 {
-    ssize_t result = 0;
-    PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
-
-    struct aesd_dev *dev = filp->private_data;
+    PDEBUG("set_depth with depth=%u", new_depth);
 
-    PDEBUG("read locking buf");
-    if (mutex_lock_interruptible(&dev->buf_lock)) {
-        PDEBUG("read lock interrupted");
-        return -ERESTARTSYS;
+    if (new_depth == 0 || new_depth > AESDCHAR_MAX_DEPTH) {
+        PDEBUG("depth %u out of range", new_depth);
+        return -EINVAL;
     }
-    PDEBUG("read buf locked");
-
-    // Search the buffer for the entry corresponding to the file position
-    size_t offset = 0;
-    struct aesd_buffer_entry *entry
-        = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buf, *f_pos, &offset);
 
-    if (entry == NULL) {
-        // Offset is past the end of data (EOF)
-        PDEBUG("read end of file");
-        result = 0;
-        goto out;
+    // Allocate new storage up front so the buffer lock isn't held across the allocation
+    size_t capacity = aesd_circular_buffer_capacity_for_depth(new_depth);
+    struct aesd_buffer_entry *storage = NULL;
+    if (capacity > AESDCHAR_INLINE_CAPACITY) {
+        storage = kvmalloc_array(capacity, sizeof(*storage), GFP_KERNEL);
+        if (storage == NULL) {
+            return -ENOMEM;
+        }
     }
 
-    size_t read_count = entry->size - offset;
-    if (read_count > count) {
-        read_count = count;
+    if (aesd_lock(dev, &dev->buf_lock, AESD_LOCK_BUF, true)) {
+        PDEBUG("set_depth lock interrupted");
+        kvfree(storage);
+        return -ERESTARTSYS;
     }
-    PDEBUG("read copying %zu bytes to user buf", read_count);
-    if (copy_to_user(buf, entry->buffptr + offset, read_count)) {
-        PDEBUG("read error copying to user buffer");
-        result = -EFAULT;
-        goto out;
+    aesd_merge_shards(dev);
+    // Drop the oldest entries that no longer fit, a batch at a time
+    while (aesd_circular_buffer_count(&dev->buf) > new_depth) {
+        const char *removed[AESD_EVICT_BATCH];
+        size_t removed_count = 0;
+        struct aesd_buffer_entry entry;
+        size_t tail = dev->buf.base_offs;
+        write_seqcount_begin(&dev->buf_seq);
+        while (
+            removed_count < ARRAY_SIZE(removed) && aesd_circular_buffer_count(&dev->buf) > new_depth
+        ) {
+            aesd_circular_buffer_remove_entry(&dev->buf, &entry);
+            removed[removed_count++] = entry.buffptr;
+        }
+        write_seqcount_end(&dev->buf_seq);
+        aesd_count_evictions(dev, removed_count, tail);
+        aesd_free_entries(dev, removed, removed_count);
     }
-
-    result = read_count;
-    *f_pos += read_count;
-    PDEBUG("read returning count=%zu offset=%lld", read_count, *f_pos);
-
-out:
+    write_seqcount_begin(&dev->buf_seq);
+    storage = aesd_circular_buffer_resize(&dev->buf, storage, capacity, new_depth);
+    write_seqcount_end(&dev->buf_seq);
+    aesd_mmap_publish(dev, 0);
     mutex_unlock(&dev->buf_lock);
-    PDEBUG("read unlock buf");
-    return result;
+
+    // Free the storage the buffer moved away from once lockless readers are done with its slots
+    if (storage != NULL) {
+        synchronize_srcu(&dev->srcu);
+        kvfree(storage);
+    }
+    return 0;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+long aesd_set_policy(struct aesd_dev *dev, const struct aesd_policy *policy)
 {
-    ssize_t result = -ENOMEM;
-    PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
+    PDEBUG(
+        "set_policy with max_entries=%u max_age_ms=%u max_bytes=%llu",
+        policy->max_entries,
+        policy->max_age_ms,
+        (unsigned long long)policy->max_bytes
+    );
 
-    struct aesd_dev *dev = filp->private_data;
+    if (policy->max_entries != 0) {
+        long result = aesd_set_depth(dev, policy->max_entries);
+        if (result) {
+            return result;
+        }
+    }
 
-    PDEBUG("write locking entry");
-    if (mutex_lock_interruptible(&dev->entry_lock)) {
-        PDEBUG("write lock interrupted");
+    if (aesd_lock(dev, &dev->buf_lock, AESD_LOCK_BUF, true)) {
+        PDEBUG("set_policy lock interrupted");
         return -ERESTARTSYS;
     }
-    PDEBUG("write entry locked");
+    aesd_merge_shards(dev);
+    write_seqcount_begin(&dev->buf_seq);
+    dev->buf.max_bytes = policy->max_bytes;
+    dev->buf.max_age = msecs_to_jiffies(policy->max_age_ms);
+    write_seqcount_end(&dev->buf_seq);
+    // Drop anything the new limits no longer allow, and expire the rest on time under them
+    aesd_trim_entries(dev);
+    mutex_unlock(&dev->buf_lock);
+    return 0;
+}
 
-    // Check for previous entry
-    if (dev->entry.buffptr == NULL) {
-        // Allocate a fresh buffer since there's no data from a previous write
-        PDEBUG("write new entry");
-        char *kbuf = kzalloc(count, GFP_KERNEL);
-        if (kbuf == NULL) {
-            result = -ENOMEM;
-            goto out;
-        }
-        if (copy_from_user(kbuf, buf, count)) {
-            result = -EFAULT;
-            kfree(kbuf);
-            goto out;
-        }
-        dev->entry.buffptr = kbuf;
-    } else {
-        // Allocate a larger buffer to append to the previous write
-        PDEBUG("write append entry");
-        char *kbuf = kzalloc(dev->entry.size + count, GFP_KERNEL);
-        if (kbuf == NULL) {
-            result = -ENOMEM;
-            goto out;
-        }
-        // Copy over the previous data and swap the buffer pointer
-        memcpy(kbuf, dev->entry.buffptr, dev->entry.size);
-        kfree(dev->entry.buffptr);
-        // Copy in the new data from the user
-        if (copy_from_user(kbuf + dev->entry.size, buf, count)) {
-            result = -EFAULT;
-            kfree(kbuf);
-            goto out;
+/**
+ * @brief   Fill the totals of @param meta from the device of @param filp, and copy the sizes of
+ *          the write commands it asks for to its lengths array.
+ *
+ * Everything is read under a single buf_lock hold, so the sizes add up to the totals. The sizes
+ * are gathered in a kernel buffer first, so the lock isn't held across the copy to user space.
+ *
+ * @return  0 on success, or a negative error code.
+ */
+long aesd_get_metadata(struct file *filp, struct aesd_metadata *meta)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    uint64_t __user *lengths = u64_to_user_ptr(meta->lengths);
+    // No more entries than the maximum depth can be held
+    size_t lengths_len = lengths != NULL ? min(meta->lengths_len, AESDCHAR_MAX_DEPTH) : 0;
+    uint64_t *sizes = NULL;
+    if (lengths_len > 0) {
+        sizes = kvmalloc_array(lengths_len, sizeof(*sizes), GFP_KERNEL);
+        if (sizes == NULL) {
+            return -ENOMEM;
         }
-        dev->entry.buffptr = kbuf;
     }
-    dev->entry.size += count;
 
-    // Check for newline to mark the end of the entry
-    PDEBUG("write locking buf");
-    if (mutex_lock_interruptible(&dev->buf_lock)) {
-        PDEBUG("write lock interrupted");
-        result = -EINTR;
-        goto out;
+    if (aesd_lock(dev, &dev->buf_lock, AESD_LOCK_BUF, true)) {
+        kvfree(sizes);
+        return -ERESTARTSYS;
     }
-    PDEBUG("write buf locked");
-    if (dev->entry.buffptr[dev->entry.size - 1] == '\n') {
-        PDEBUG("write push entry");
-        const char *old_data = aesd_circular_buffer_add_entry(&dev->buf, &dev->entry);
-        // Clean up old entry data dropped from the buffer
-        if (old_data != NULL) {
-            PDEBUG("write drop entry");
-            kfree(old_data);
-        }
-        // Reset the entry for the next write
-        dev->entry.buffptr = NULL;
-        dev->entry.size = 0;
+    aesd_merge_shards(dev);
+    size_t count = aesd_circular_buffer_count(&dev->buf);
+    meta->total_bytes = aesd_circular_buffer_size(&dev->buf);
+    meta->first_seq = dev->entry_seq - count;
+    meta->entry_count = count;
+    size_t filled = 0;
+    while (filled < lengths_len && meta->first_entry + filled < count) {
+        sizes[filled] = aesd_circular_buffer_get_entry_at_out_index(
+            &dev->buf, meta->first_entry + filled
+        )->size;
+        filled++;
     }
-    result = count;
-    *f_pos += count;
     mutex_unlock(&dev->buf_lock);
-    PDEBUG("write buf unlocked");
+    meta->pending_bytes = READ_ONCE(file->entry.size);
+    meta->lengths_len = filled;
 
-out:
-    mutex_unlock(&dev->entry_lock);
-    PDEBUG("write entry unlocked");
+    long result = 0;
+    if (filled > 0 && copy_to_user(lengths, sizes, filled * sizeof(*sizes)) != 0) {
+        result = -EFAULT;
+    }
+    kvfree(sizes);
     return result;
 }
 
-long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd, uint32_t write_cmd_offset)
-{
-    PDEBUG(
-        "adjust_file_offset with write_cmd=%u and write_cmd_offset=%u", write_cmd, write_cmd_offset
-    );
-
-    struct aesd_dev *dev = filp->private_data;
-    long result = 0;
+/**
+ * @brief   Copy the data of @param entry of @param dev to user space at @param dst, splitting the
+ *          copy at the wrap point of the ring in arena mode.
+ * @return  0 on success, or -EFAULT.
+ */
+static int aesd_entry_copy_to_user(
+    struct aesd_dev *dev, char __user *dst, const struct aesd_buffer_entry *entry
+) {
+    size_t first = entry->size;
+    if (dev->arena != NULL) {
+        first = min_t(size_t, first, dev->arena + dev->arena_mask + 1 - entry->buffptr);
+    }
+    if (copy_to_user(dst, entry->buffptr, first) != 0) {
+        return -EFAULT;
+    }
+    if (first < entry->size && copy_to_user(dst + first, dev->arena, entry->size - first) != 0) {
+        return -EFAULT;
+    }
+    return 0;
+}
 
-    // Simple bounds check that doesn't require locking the mutex
-    if (write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-        PDEBUG(
-            "write_cmd %u greater than max %u", write_cmd, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
-        );
-        result = -EINVAL;
-        goto out;
+/**
+ * @brief   Copy the whole write commands of @param dev in the range of @param records that fit in
+ *          its buffer, preceded by a table of their sizes.
+ *
+ * The range is found and copied under a single buf_lock hold, so the records are consecutive and
+ * none is evicted halfway through the copy. Writers wait for the copy, which is bounded by the
+ * size of the user buffer.
+ *
+ * @return  The number of records copied, -EMSGSIZE if the first one doesn't fit, or a negative
+ *          error code.
+ */
+long aesd_read_records(struct aesd_dev *dev, const struct aesd_records *records)
+{
+    uint64_t __user *lengths = u64_to_user_ptr(records->buf);
+    if (aesd_lock(dev, &dev->buf_lock, AESD_LOCK_BUF, true)) {
+        return -ERESTARTSYS;
     }
-    if (mutex_lock_interruptible(&dev->buf_lock)) {
-        PDEBUG("write lock interrupted");
-        result = -ERESTARTSYS;
-        goto out;
+    aesd_merge_shards(dev);
+    size_t count = aesd_circular_buffer_count(&dev->buf);
+    // Find how many records fit, each taking a slot of the size table besides its data
+    size_t fit = 0;
+    size_t data_size = 0;
+    while (fit < records->max_records && records->first_record + fit < count) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry_at_out_index(
+            &dev->buf, records->first_record + fit
+        );
+        if ((fit + 1) * sizeof(*lengths) + data_size + entry->size > records->buf_len) {
+            break;
+        }
+        data_size += entry->size;
+        fit++;
     }
-    // Start by adding up write cmd lengths
-    loff_t f_pos = 0;
-    struct aesd_buffer_entry *entry = NULL;
-    for (size_t i = 0; i < write_cmd; i++) {
-        entry = aesd_circular_buffer_get_entry_at_out_index(&dev->buf, i);
-        if (entry == NULL) {
-            PDEBUG("no write_cmd found at index %u", i);
-            result = -EINVAL;
-            goto out_unlock_buf;
-        }
-        f_pos += entry->size;
-    }
-    // Then check the offset into the final write command
-    entry = aesd_circular_buffer_get_entry_at_out_index(&dev->buf, write_cmd);
-    if (entry == NULL) {
-        PDEBUG("no write_cmd found at index %d", write_cmd);
-        result = -EINVAL;
-        goto out_unlock_buf;
+    long result = fit;
+    if (fit == 0 && records->max_records > 0 && records->first_record < count) {
+        PDEBUG("record %u doesn't fit in %llu bytes", records->first_record, records->buf_len);
+        result = -EMSGSIZE;
     }
-    if (write_cmd_offset >= entry->size) {
-        PDEBUG("write_cmd_offset %u greater than entry size %u", write_cmd_offset, entry->size);
-        result = -EINVAL;
-        goto out_unlock_buf;
+
+    char __user *data = (char __user *)(lengths + fit);
+    for (size_t i = 0; i < fit; i++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry_at_out_index(
+            &dev->buf, records->first_record + i
+        );
+        if (
+            put_user((uint64_t)entry->size, lengths + i)
+                || aesd_entry_copy_to_user(dev, data, entry)
+        ) {
+            result = -EFAULT;
+            break;
+        }
+        data += entry->size;
     }
-    f_pos += write_cmd_offset;
-    // Overwrite f_pos
-    PDEBUG("setting f_pos = %llu", f_pos);
-    filp->f_pos = f_pos;
-out_unlock_buf:
     mutex_unlock(&dev->buf_lock);
-out:
     return result;
 }
 
+/**
+ * @brief   Create a device instance at the lowest free minor.
+ * @return  The index of the new instance, or a negative error code.
+ */
+static int aesd_create_instance(void);
+
+/**
+ * @brief   Destroy the device instance at @param index. Files already open on it keep working
+ *          until they are closed.
+ * @return  0 on success, or a negative error code.
+ */
+static int aesd_destroy_instance(unsigned int index);
+
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     PDEBUG("ioctl with cmd=%u and arg=%lu", cmd, arg);
+    struct aesd_file *file = filp->private_data;
     long result = 0;
     switch (cmd) {
         case AESDCHAR_IOCSEEKTO:
@@ -275,6 +1759,64 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             }
             break;
         }
+        case AESDCHAR_IOCGMETADATA:
+        {
+            struct aesd_metadata meta = {0};
+            if (copy_from_user(&meta, (const void __user *)arg, sizeof(meta)) != 0) {
+                result = -EFAULT;
+            } else {
+                result = aesd_get_metadata(filp, &meta);
+            }
+            if (result == 0 && copy_to_user((void __user *)arg, &meta, sizeof(meta)) != 0) {
+                result = -EFAULT;
+            }
+            break;
+        }
+        case AESDCHAR_IOCSDEPTH:
+        {
+            uint32_t new_depth = 0;
+            if (copy_from_user(&new_depth, (const void __user *)arg, sizeof(new_depth)) != 0) {
+                result = -EFAULT;
+            } else {
+                result = aesd_set_depth(file->dev, new_depth);
+            }
+            break;
+        }
+        case AESDCHAR_IOCSPOLICY:
+        {
+            struct aesd_policy policy = {0};
+            if (copy_from_user(&policy, (const void __user *)arg, sizeof(policy)) != 0) {
+                result = -EFAULT;
+            } else {
+                result = aesd_set_policy(file->dev, &policy);
+            }
+            break;
+        }
+        case AESDCHAR_IOCCREATE:
+            result = capable(CAP_SYS_ADMIN) ? aesd_create_instance() : -EPERM;
+            break;
+        case AESDCHAR_IOCDESTROY:
+        {
+            uint32_t index = 0;
+            if (!capable(CAP_SYS_ADMIN)) {
+                result = -EPERM;
+            } else if (copy_from_user(&index, (const void __user *)arg, sizeof(index)) != 0) {
+                result = -EFAULT;
+            } else {
+                result = aesd_destroy_instance(index);
+            }
+            break;
+        }
+        case AESDCHAR_IOCRECORDS:
+        {
+            struct aesd_records records = {0};
+            if (copy_from_user(&records, (const void __user *)arg, sizeof(records)) != 0) {
+                result = -EFAULT;
+            } else {
+                result = aesd_read_records(file->dev, &records);
+            }
+            break;
+        }
         default:
             PDEBUG("unsupported ioctl");
             break;
@@ -282,47 +1824,351 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return result;
 }
 
+__poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    // Writes never block
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &dev->wait, wait);
+    // Pairs with wq_has_sleeper() in aesd_notify_readers(), so a writer that doesn't see this
+    // waiter committed its entries before they are checked below
+    smp_mb();
+    aesd_lock(dev, &dev->buf_lock, AESD_LOCK_BUF, false);
+    aesd_merge_shards(dev);
+    loff_t f_pos = filp->f_pos;
+    if (
+        (file->at_eof && f_pos == file->eof_fpos)
+            ? aesd_stream_head(dev) != file->eof_offs
+            : f_pos < aesd_circular_buffer_size(&dev->buf)
+    ) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    mutex_unlock(&dev->buf_lock);
+    PDEBUG("poll returning %#x", (unsigned int)mask);
+    return mask;
+}
+
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    PDEBUG("mmap %lu bytes at page offset %lu", vma->vm_end - vma->vm_start, vma->vm_pgoff);
+
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
+    if (dev->mmap_header == NULL) {
+        // Without arena storage the history is scattered across separate allocations
+        PDEBUG("mmap requires arena storage");
+        return -ENODEV;
+    }
+    if (vma->vm_flags & VM_WRITE) {
+        PDEBUG("mmap must be read-only");
+        return -EPERM;
+    }
+    // Keep the mapping from being made writable later with mprotect()
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    // The header and arena are one allocation, which also bounds the size of the mapping
+    return remap_vmalloc_range(vma, dev->mmap_header, vma->vm_pgoff);
+}
+
 struct file_operations g_aesd_fops = {
     .owner   = THIS_MODULE,
     .llseek  = aesd_llseek,
-    .read    = aesd_read,
-    .write   = aesd_write,
+    .read_iter = aesd_read_iter,
+    .write_iter = aesd_write_iter,
+    // Splice through read_iter into kernel pages, so sendfile() to a socket skips user space
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
     .unlocked_ioctl = aesd_ioctl,
+    .poll    = aesd_poll,
+    .mmap    = aesd_mmap,
     .open    = aesd_open,
     .release = aesd_release,
+    .fasync  = aesd_fasync,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static void aesd_free_device(struct kref *ref)
+{
+    struct aesd_dev *dev = container_of(ref, struct aesd_dev, ref);
+
+    // A merge still running commits entries, which arms expire_work, so cancel it first.
+    // expire_work only rearms itself, which cancel_delayed_work_sync() handles.
+    if (dev->shards != NULL) {
+        cancel_work_sync(&dev->merge_work);
+    }
+    cancel_delayed_work_sync(&dev->expire_work);
+    if (dev->shards != NULL) {
+        int cpu;
+        for_each_possible_cpu(cpu) {
+            struct aesd_shard *shard = per_cpu_ptr(dev->shards, cpu);
+            for (unsigned int i = 0; i < shard->count; i++) {
+                kvfree(shard->entry[(shard->out + i) & (AESD_SHARD_ENTRIES - 1)].buffptr);
+            }
+        }
+        free_percpu(dev->shards);
+        kvfree(dev->merge_entries);
+    }
+
+    // Let the data of evicted entries still waiting on a grace period be freed
+    srcu_barrier(&dev->srcu);
+
+    // Free any remaining buffer entries
+    size_t i = 0;
+    struct aesd_buffer_entry *entry = NULL;
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buf, i) {
+        if (entry->buffptr != NULL) {
+            aesd_free_entry_data(dev, entry->buffptr);
+        }
+    }
+    vfree(dev->mmap_header);
+    // Free the entry storage if the buffer was resized beyond the inline slots
+    if (dev->buf.entry != dev->buf.inline_entry) {
+        kvfree(dev->buf.entry);
+    }
+    cleanup_srcu_struct(&dev->srcu);
+    free_percpu(dev->stats);
+    kfree(dev);
+}
+
+/**
+ * @brief   Allocate a device with the storage and retention policy given by the module parameters.
+ * @return  The device, holding one reference, or an ERR_PTR() on failure.
+ */
+static struct aesd_dev *aesd_alloc_device(void)
+{
+    struct aesd_dev *dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (dev == NULL) {
+        return ERR_PTR(-ENOMEM);
+    }
+    dev->stats = alloc_percpu(struct aesd_stats);
+    if (dev->stats == NULL) {
+        kfree(dev);
+        return ERR_PTR(-ENOMEM);
+    }
+    aesd_circular_buffer_init(&dev->buf);
+    mutex_init(&dev->buf_lock);
+    seqcount_mutex_init(&dev->buf_seq, &dev->buf_lock);
+    init_waitqueue_head(&dev->wait);
+    kref_init(&dev->ref);
+    INIT_DELAYED_WORK(&dev->expire_work, aesd_expire_work);
+    int result = init_srcu_struct(&dev->srcu);
+    if (result) {
+        printk(KERN_WARNING "Can't init srcu\n");
+        free_percpu(dev->stats);
+        kfree(dev);
+        return ERR_PTR(result);
+    }
+
+    if (arena_size != 0) {
+        // Round up so stream offsets map to arena offsets with a mask
+        size_t size = roundup_pow_of_two(max(arena_size, PAGE_SIZE));
+        // The arena follows the mmap header so one remap_vmalloc_range() maps both
+        char *region = vmalloc_user(AESD_MMAP_HEADER_SIZE + size);
+        if (region == NULL) {
+            printk(KERN_WARNING "Can't allocate %zu byte arena\n", size);
+            kref_put(&dev->ref, aesd_free_device);
+            return ERR_PTR(-ENOMEM);
+        }
+        struct aesd_mmap_header *header = (struct aesd_mmap_header *)region;
+        header->header_size = AESD_MMAP_HEADER_SIZE;
+        header->data_size = size;
+        header->entries_len = rounddown_pow_of_two(
+            (AESD_MMAP_HEADER_SIZE - sizeof(*header)) / sizeof(header->entries[0])
+        );
+        dev->mmap_header = header;
+        dev->arena = region + AESD_MMAP_HEADER_SIZE;
+        dev->arena_mask = size - 1;
+    }
+
+    if (sharded) {
+        dev->merge_entries = kvmalloc_array(
+            num_possible_cpus() * AESD_SHARD_ENTRIES, sizeof(*dev->merge_entries), GFP_KERNEL
+        );
+        dev->shards = alloc_percpu(struct aesd_shard);
+        if (dev->merge_entries == NULL || dev->shards == NULL) {
+            printk(KERN_WARNING "Can't allocate shards\n");
+            kvfree(dev->merge_entries);
+            free_percpu(dev->shards);
+            dev->shards = NULL;
+            kref_put(&dev->ref, aesd_free_device);
+            return ERR_PTR(-ENOMEM);
+        }
+        int cpu;
+        for_each_possible_cpu(cpu) {
+            spin_lock_init(&per_cpu_ptr(dev->shards, cpu)->lock);
+        }
+        atomic64_set(&dev->shard_seq, 0);
+        INIT_WORK(&dev->merge_work, aesd_merge_work);
+    }
+
+    struct aesd_policy policy = {
+        .max_entries = depth,
+        .max_age_ms = max_age_ms,
+        .max_bytes = max_bytes,
+    };
+    result = aesd_set_policy(dev, &policy);
+    if (result) {
+        printk(KERN_WARNING "Can't set retention policy\n");
+        kref_put(&dev->ref, aesd_free_device);
+        return ERR_PTR(result);
+    }
+    return dev;
+}
+
+/**
+ * @brief   Create the device instance at @param index, which must be free, with its cdev and
+ *          device node. Called with g_aesd_devices_lock held.
+ * @return  0 on success, or a negative error code.
+ */
+static int aesd_add_device(unsigned int index)
+{
+    dev_t devno = MKDEV(g_aesd_major, g_aesd_minor + index);
+    struct aesd_dev *dev = aesd_alloc_device();
+    if (IS_ERR(dev)) {
+        return PTR_ERR(dev);
+    }
+    dev->devt = devno;
+
+    int result = 0;
+    dev->cdev = cdev_alloc();
+    if (dev->cdev == NULL) {
+        result = -ENOMEM;
+        goto out;
+    }
+    dev->cdev->owner = THIS_MODULE;
+    dev->cdev->ops = &g_aesd_fops;
+    result = cdev_add(dev->cdev, devno, 1);
+    if (result) {
+        printk(KERN_ERR "Error %d adding aesd cdev", result);
+        kobject_put(&dev->cdev->kobj);
+        goto out;
+    }
+
+    struct device *device = device_create(g_aesd_class, NULL, devno, NULL, "aesdchar%u", index);
+    if (IS_ERR(device)) {
+        result = PTR_ERR(device);
+        printk(KERN_ERR "Error %d creating aesdchar%u", result, index);
+        cdev_del(dev->cdev);
+        goto out;
+    }
+    g_aesd_devices[index] = dev;
+
+    char name[16];
+    snprintf(name, sizeof(name), "aesdchar%u", index);
+    dev->debugfs = debugfs_create_dir(name, g_aesd_debugfs);
+    debugfs_create_file("stats", 0444, dev->debugfs, dev, &aesd_stats_fops);
+
+out:
+    if (result) {
+        kref_put(&dev->ref, aesd_free_device);
+    }
+    return result;
+}
+
+/**
+ * @brief   Remove the device instance at @param index from the table and the system, freeing it
+ *          once no file has it open. Called with g_aesd_devices_lock held.
+ */
+static void aesd_remove_device(unsigned int index)
+{
+    struct aesd_dev *dev = g_aesd_devices[index];
+    g_aesd_devices[index] = NULL;
+    // Waits for any reader of the stats file to finish with dev
+    debugfs_remove_recursive(dev->debugfs);
+    device_destroy(g_aesd_class, MKDEV(g_aesd_major, g_aesd_minor + index));
+    cdev_del(dev->cdev);
+    kref_put(&dev->ref, aesd_free_device);
+}
+
+static int aesd_create_instance(void)
+{
+    mutex_lock(&g_aesd_devices_lock);
+    int result = -ENOSPC;
+    for (unsigned int index = 0; index < AESD_MAX_INSTANCES; index++) {
+        if (g_aesd_devices[index] == NULL) {
+            result = aesd_add_device(index);
+            if (result == 0) {
+                result = index;
+            }
+            break;
+        }
+    }
+    mutex_unlock(&g_aesd_devices_lock);
+    return result;
+}
+
+static int aesd_destroy_instance(unsigned int index)
 {
-    int devno = MKDEV(g_aesd_major, g_aesd_minor);
-    cdev_init(&dev->cdev, &g_aesd_fops);
-    dev->cdev.owner = THIS_MODULE;
-    dev->cdev.ops = &g_aesd_fops;
-    int err = cdev_add(&dev->cdev, devno, 1);
-    if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+    mutex_lock(&g_aesd_devices_lock);
+    int result = -ENODEV;
+    if (index < AESD_MAX_INSTANCES && g_aesd_devices[index] != NULL) {
+        aesd_remove_device(index);
+        result = 0;
     }
-    return err;
+    mutex_unlock(&g_aesd_devices_lock);
+    return result;
 }
 
+void aesd_cleanup_module(void);
+
 int aesd_init_module(void)
 {
+    if (instances == 0 || instances > AESD_MAX_INSTANCES) {
+        printk(KERN_WARNING "instances must be between 1 and %d\n", AESD_MAX_INSTANCES);
+        return -EINVAL;
+    }
+    if (sharded && arena_size != 0) {
+        // Merging would have to move the data of every entry into the arena under buf_lock
+        printk(KERN_WARNING "sharded is not supported with arena_size\n");
+        return -EINVAL;
+    }
+
+    int result = aesd_pool_init();
+    if (result) {
+        aesd_pool_exit();
+        return result;
+    }
+    g_aesd_debugfs = debugfs_create_dir("aesdchar", NULL);
+    debugfs_create_file("pool", 0444, g_aesd_debugfs, NULL, &aesd_pool_fops);
+
     dev_t dev = 0;
-    int result = alloc_chrdev_region(&dev, g_aesd_minor, 1, "aesdchar");
+    result = alloc_chrdev_region(&dev, g_aesd_minor, AESD_MAX_INSTANCES, "aesdchar");
     g_aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", g_aesd_major);
+        debugfs_remove_recursive(g_aesd_debugfs);
+        aesd_pool_exit();
         return result;
     }
 
-    memset(&g_aesd_device, 0, sizeof(struct aesd_dev));
-    aesd_circular_buffer_init(&g_aesd_device.buf);
-    mutex_init(&g_aesd_device.buf_lock);
-    mutex_init(&g_aesd_device.entry_lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    g_aesd_class = class_create("aesdchar");
+#else
+    g_aesd_class = class_create(THIS_MODULE, "aesdchar");
+#endif
+    if (IS_ERR(g_aesd_class)) {
+        printk(KERN_WARNING "Can't create device class\n");
+        unregister_chrdev_region(dev, AESD_MAX_INSTANCES);
+        debugfs_remove_recursive(g_aesd_debugfs);
+        aesd_pool_exit();
+        return PTR_ERR(g_aesd_class);
+    }
 
-    result = aesd_setup_cdev(&g_aesd_device);
+    mutex_lock(&g_aesd_devices_lock);
+    for (unsigned int index = 0; index < instances && result == 0; index++) {
+        result = aesd_add_device(index);
+    }
+    mutex_unlock(&g_aesd_devices_lock);
     if (result) {
-        unregister_chrdev_region(dev, 1);
+        aesd_cleanup_module();
     }
     return result;
 }
@@ -331,18 +2177,18 @@ void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(g_aesd_major, g_aesd_minor);
 
-    // Free any remaining buffer entries
-    int i = 0;
-    struct aesd_buffer_entry *entry = NULL;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &g_aesd_device.buf, i) {
-        if (entry->buffptr != NULL) {
-            kfree(entry->buffptr);
+    mutex_lock(&g_aesd_devices_lock);
+    for (unsigned int index = 0; index < AESD_MAX_INSTANCES; index++) {
+        if (g_aesd_devices[index] != NULL) {
+            aesd_remove_device(index);
         }
     }
+    mutex_unlock(&g_aesd_devices_lock);
 
-    cdev_del(&g_aesd_device.cdev);
-
-    unregister_chrdev_region(devno, 1);
+    class_destroy(g_aesd_class);
+    unregister_chrdev_region(devno, AESD_MAX_INSTANCES);
+    debugfs_remove_recursive(g_aesd_debugfs);
+    aesd_pool_exit();
 }
 
 module_init(aesd_init_module);
@@ -0,0 +1,357 @@
+/**
+ * @file    bench_circular_buffer.c
+ * @brief   Microbenchmark and performance regression check for the aesd circular buffer.
+ *
+ * Drives aesd_circular_buffer_add_entry(), aesd_circular_buffer_find_entry_offset_for_fpos()
+ * and aesd_circular_buffer_get_entry_at_out_index() across ring depths, entry size
+ * distributions and access patterns, reporting ns/op and heap allocations per op. Allocations
+ * are counted by linking with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc.
+ *
+ * Usage: bench_circular_buffer [--baseline FILE] [--tolerance RATIO] [--write-baseline FILE]
+ *
+ * With --baseline, every case is compared against the stored numbers and the program exits with
+ * a failure status if any case is slower than baseline * RATIO (default 2.0) or allocates more.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+/** @brief  Number of operations timed per repetition of a case. */
+#define OPS_PER_CASE 200000U
+/** @brief  Repetitions of each case, the fastest one is reported. */
+#define REPETITIONS 5
+/** @brief  Number of precomputed random values cycled through by the random patterns. */
+#define RANDOM_POOL 4096U
+/** @brief  Largest entry size produced by any distribution. */
+#define MAX_ENTRY_SIZE (64U * 1024U)
+/** @brief  Longest case name. */
+#define NAME_LEN 64
+/** @brief  Most cases supported in a baseline file. */
+#define MAX_CASES 128
+
+/** @brief  Heap allocations made since the program started. */
+static unsigned long g_allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    g_allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    g_allocations++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    g_allocations++;
+    return __real_realloc(ptr, size);
+}
+
+/** @brief  Entry size distribution. */
+enum size_dist
+{
+    /** @brief  Every entry is 16 bytes, like short log lines. */
+    SIZE_FIXED,
+    /** @brief  Uniform between 1 and 512 bytes. */
+    SIZE_UNIFORM,
+    /** @brief  Mostly small entries with an occasional 64 KiB one. */
+    SIZE_HEAVY_TAIL,
+};
+
+static const char *const g_size_dist_names[] = {"fixed16", "uniform512", "heavytail"};
+
+/** @brief  Result of one benchmark case. */
+struct bench_result
+{
+    char name[NAME_LEN];
+    double ns_per_op;
+    double allocs_per_op;
+};
+
+/** @brief  Source of entry data, entries only reference it. */
+static char g_data[MAX_ENTRY_SIZE];
+/** @brief  Volatile sink keeping the compiler from discarding lookups. */
+static volatile size_t g_sink;
+
+static size_t next_entry_size(enum size_dist dist)
+{
+    switch (dist) {
+        case SIZE_FIXED:
+            return 16;
+        case SIZE_UNIFORM:
+            return 1 + (size_t)rand() % 512;
+        case SIZE_HEAVY_TAIL:
+        default:
+            return rand() % 100 == 0 ? MAX_ENTRY_SIZE : 1 + (size_t)rand() % 64;
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief   Allocate entry storage for @param depth and fill the buffer to steady state.
+ */
+static struct aesd_buffer_entry *setup_buffer(
+    struct aesd_circular_buffer *buffer, size_t depth, enum size_dist dist, size_t *sizes
+) {
+    aesd_circular_buffer_init(buffer);
+    size_t capacity = aesd_circular_buffer_capacity_for_depth(depth);
+    struct aesd_buffer_entry *storage = malloc(capacity * sizeof(*storage));
+    aesd_circular_buffer_resize(buffer, storage, capacity, depth);
+    for (size_t i = 0; i < depth; i++) {
+        struct aesd_buffer_entry entry = {.buffptr = g_data, .size = next_entry_size(dist)};
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    for (size_t i = 0; i < RANDOM_POOL; i++) {
+        sizes[i] = next_entry_size(dist);
+    }
+    return storage;
+}
+
+/** @brief  Access pattern of a case. */
+enum pattern
+{
+    /** @brief  aesd_circular_buffer_add_entry() on a full buffer, evicting every time. */
+    PATTERN_ADD,
+    /** @brief  Offset lookups walking the history front to back. */
+    PATTERN_FIND_SEQUENTIAL,
+    /** @brief  Offset lookups at random positions. */
+    PATTERN_FIND_RANDOM,
+    /** @brief  AESDCHAR_IOCSEEKTO style: entry by index, its offset, then an offset lookup. */
+    PATTERN_SEEK,
+    /** @brief  aesd_circular_buffer_get_entry_at_out_index() at random indices. */
+    PATTERN_GET_RANDOM,
+};
+
+static const char *const g_pattern_names[] = {
+    "add_entry", "find_sequential", "find_random", "seek", "get_entry_random",
+};
+
+/**
+ * @brief   Time one case and fill in @param result.
+ */
+static void run_case(
+    enum pattern pattern, size_t depth, enum size_dist dist, struct bench_result *result
+) {
+    static size_t sizes[RANDOM_POOL];
+    static size_t randoms[RANDOM_POOL];
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *storage = setup_buffer(&buffer, depth, dist, sizes);
+    for (size_t i = 0; i < RANDOM_POOL; i++) {
+        randoms[i] = (size_t)rand();
+    }
+
+    double best_ns = 0;
+    unsigned long allocations = 0;
+    for (int rep = 0; rep < REPETITIONS; rep++) {
+        size_t total_size = aesd_circular_buffer_size(&buffer);
+        size_t count = aesd_circular_buffer_count(&buffer);
+        size_t fpos = 0;
+        size_t sink = 0;
+        unsigned long allocations_before = g_allocations;
+        uint64_t start = now_ns();
+        for (size_t op = 0; op < OPS_PER_CASE; op++) {
+            size_t r = randoms[op % RANDOM_POOL];
+            size_t entry_offset = 0;
+            struct aesd_buffer_entry *entry = NULL;
+            switch (pattern) {
+                case PATTERN_ADD:
+                {
+                    struct aesd_buffer_entry add = {
+                        .buffptr = g_data, .size = sizes[op % RANDOM_POOL]
+                    };
+                    sink += (size_t)aesd_circular_buffer_add_entry(&buffer, &add);
+                    break;
+                }
+                case PATTERN_FIND_SEQUENTIAL:
+                    // Step through the history in 256 byte reads, wrapping at the end
+                    entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+                        &buffer, fpos, &entry_offset
+                    );
+                    fpos = fpos + 256 < total_size ? fpos + 256 : 0;
+                    break;
+                case PATTERN_FIND_RANDOM:
+                    entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+                        &buffer, r % total_size, &entry_offset
+                    );
+                    break;
+                case PATTERN_SEEK:
+                    entry = aesd_circular_buffer_get_entry_at_out_index(&buffer, r % count);
+                    entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+                        &buffer, aesd_circular_buffer_entry_fpos(&buffer, entry), &entry_offset
+                    );
+                    break;
+                case PATTERN_GET_RANDOM:
+                    entry = aesd_circular_buffer_get_entry_at_out_index(&buffer, r % count);
+                    break;
+            }
+            sink += entry_offset + (entry != NULL ? entry->size : 0);
+        }
+        uint64_t elapsed = now_ns() - start;
+        allocations += g_allocations - allocations_before;
+        g_sink = sink;
+        double ns = (double)elapsed / OPS_PER_CASE;
+        if (rep == 0 || ns < best_ns) {
+            best_ns = ns;
+        }
+    }
+
+    snprintf(
+        result->name,
+        sizeof(result->name),
+        "%s/depth=%zu/%s",
+        g_pattern_names[pattern],
+        depth,
+        g_size_dist_names[dist]
+    );
+    result->ns_per_op = best_ns;
+    result->allocs_per_op = (double)allocations / ((double)OPS_PER_CASE * REPETITIONS);
+    free(storage);
+}
+
+/**
+ * @brief   Load a baseline file of "name ns_per_op allocs_per_op" lines, '#' starts a comment.
+ *
+ * @return  The number of cases loaded, or -1 if the file couldn't be opened.
+ */
+static int load_baseline(const char *path, struct bench_result *baseline)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    int count = 0;
+    char line[256];
+    while (count < MAX_CASES && fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        struct bench_result *entry = &baseline[count];
+        if (
+            sscanf(line, "%63s %lf %lf", entry->name, &entry->ns_per_op, &entry->allocs_per_op)
+            == 3
+        ) {
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+int main(int argc, char **argv)
+{
+    const char *baseline_path = NULL;
+    const char *write_path = NULL;
+    double tolerance = 2.0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--write-baseline") == 0 && i + 1 < argc) {
+            write_path = argv[++i];
+        } else {
+            fprintf(
+                stderr,
+                "usage: %s [--baseline FILE] [--tolerance RATIO] [--write-baseline FILE]\n",
+                argv[0]
+            );
+            return 1;
+        }
+    }
+
+    static struct bench_result baseline[MAX_CASES];
+    int baseline_count = 0;
+    if (baseline_path != NULL && (baseline_count = load_baseline(baseline_path, baseline)) < 0) {
+        return 1;
+    }
+    FILE *write_file = NULL;
+    if (write_path != NULL) {
+        write_file = fopen(write_path, "w");
+        if (write_file == NULL) {
+            perror(write_path);
+            return 1;
+        }
+        fprintf(write_file, "# name ns_per_op allocs_per_op\n");
+        fprintf(
+            write_file,
+            "# Reference numbers for the bench target, regenerate with the bench-baseline target\n"
+        );
+    }
+
+    static const size_t depths[] = {16, 1024, 65536};
+    srand(5305);
+    int failures = 0;
+    printf("%-44s %10s %10s %10s\n", "case", "ns/op", "allocs/op", "baseline");
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        for (int dist = SIZE_FIXED; dist <= SIZE_HEAVY_TAIL; dist++) {
+            for (int pattern = PATTERN_ADD; pattern <= PATTERN_GET_RANDOM; pattern++) {
+                struct bench_result result;
+                run_case((enum pattern)pattern, depths[d], (enum size_dist)dist, &result);
+                printf("%-44s %10.2f %10.4f", result.name, result.ns_per_op, result.allocs_per_op);
+                if (write_file != NULL) {
+                    fprintf(
+                        write_file,
+                        "%s %.2f %.4f\n",
+                        result.name,
+                        result.ns_per_op,
+                        result.allocs_per_op
+                    );
+                }
+
+                // Compare against the stored numbers for this case, if any
+                const struct bench_result *base = NULL;
+                for (int i = 0; i < baseline_count; i++) {
+                    if (strcmp(baseline[i].name, result.name) == 0) {
+                        base = &baseline[i];
+                        break;
+                    }
+                }
+                if (base == NULL) {
+                    printf(" %10s\n", baseline_path != NULL ? "missing" : "");
+                    continue;
+                }
+                printf(" %10.2f", base->ns_per_op);
+                if (result.ns_per_op > base->ns_per_op * tolerance) {
+                    printf("  SLOWER");
+                    failures++;
+                }
+                if (result.allocs_per_op > base->allocs_per_op + 0.0001) {
+                    printf("  MORE ALLOCS");
+                    failures++;
+                }
+                printf("\n");
+            }
+        }
+    }
+
+    if (write_file != NULL) {
+        fclose(write_file);
+    }
+    if (failures) {
+        fprintf(stderr, "%d regression(s) against %s\n", failures, baseline_path);
+        return 1;
+    }
+    return 0;
+}
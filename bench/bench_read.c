@@ -0,0 +1,320 @@
+/**
+ * @file    bench_read.c
+ * @brief   Calls and time per full-history read of aesdchar, per-entry against multi-entry reads.
+ *
+ * Without arguments, models the heap mode read path of aesd_read() in userspace: every call
+ * takes a mutex standing in for buf_lock and copies into the caller's buffer. The per-entry
+ * variant copies at most the rest of one entry per call, as aesd_read() used to. The
+ * multi-entry variant copies from as many consecutive entries as fit. The cursor variant does the
+ * same but continues from where the previous read ended instead of searching for its position,
+ * as aesd_read() does in heap mode. Each configuration dumps the whole history with aesdsocket's
+ * 256 byte reads and with one read the size of the history.
+ *
+ * With --device, reads the whole history of a loaded aesdchar device instead, so the numbers
+ * can be compared on real hardware before and after loading a new module. --threads runs the
+ * same dumps from 1, 2, 4 and so on up to the given number of threads at once, each with its own
+ * file, to show how aggregate read throughput scales with the number of cores reading.
+ *
+ * Usage: bench_read [--device PATH [--threads N]] [--read-size BYTES]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-circular-buffer.h"
+
+/** @brief  Size of each record in the modeled history. */
+#define RECORD_SIZE 64U
+/** @brief  Read size used by aesdsocket. */
+#define SOCKET_READ_SIZE 256U
+/** @brief  Vectors filled per batch by the multi-entry variant, as in aesd_read(). */
+#define READ_IOVECS 8
+/** @brief  Full-history reads timed per configuration. */
+#define DUMPS 200U
+
+/** @brief  Buffer and lock modeling one aesdchar device. */
+struct model_dev
+{
+    struct aesd_circular_buffer buf;
+    pthread_mutex_t buf_lock;
+    /** @brief  Cursor of the one reader, used by the cursor variant. */
+    struct aesd_buffer_cursor cursor;
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/**
+ * @brief   One read call copying at most the rest of the entry at @param pos.
+ */
+static size_t read_per_entry(struct model_dev *dev, char *dst, size_t count, size_t *pos)
+{
+    pthread_mutex_lock(&dev->buf_lock);
+    size_t offset = 0;
+    size_t result = 0;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+        &dev->buf, *pos, &offset
+    );
+    if (entry != NULL) {
+        result = entry->size - offset;
+        if (result > count) {
+            result = count;
+        }
+        memcpy(dst, entry->buffptr + offset, result);
+        *pos += result;
+    }
+    pthread_mutex_unlock(&dev->buf_lock);
+    return result;
+}
+
+/**
+ * @brief   One read call copying from as many consecutive entries as fit in @param count bytes,
+ *          finding them through @param cursor if not NULL.
+ */
+static size_t read_entries(
+    struct model_dev *dev,
+    struct aesd_buffer_cursor *cursor,
+    char *dst,
+    size_t count,
+    size_t *pos
+) {
+    pthread_mutex_lock(&dev->buf_lock);
+    struct iovec iov[READ_IOVECS];
+    size_t result = 0;
+    size_t iov_count;
+    do {
+        size_t bytes = 0;
+        iov_count = aesd_circular_buffer_fill_iovec_cursor(
+            &dev->buf, cursor, *pos + result, count - result, iov, READ_IOVECS, &bytes
+        );
+        for (size_t i = 0; i < iov_count; i++) {
+            memcpy(dst + result, iov[i].iov_base, iov[i].iov_len);
+            result += iov[i].iov_len;
+        }
+    } while (iov_count == READ_IOVECS && result < count);
+    *pos += result;
+    pthread_mutex_unlock(&dev->buf_lock);
+    return result;
+}
+
+static size_t read_multi_entry(struct model_dev *dev, char *dst, size_t count, size_t *pos)
+{
+    return read_entries(dev, NULL, dst, count, pos);
+}
+
+static size_t read_cursor(struct model_dev *dev, char *dst, size_t count, size_t *pos)
+{
+    return read_entries(dev, &dev->cursor, dst, count, pos);
+}
+
+/**
+ * @brief   Time full-history dumps of @param dev with reads of @param read_size bytes.
+ */
+static void bench_model(
+    struct model_dev *dev,
+    const char *variant,
+    size_t (*read_fn)(struct model_dev *, char *, size_t, size_t *),
+    size_t read_size
+) {
+    char *dst = malloc(read_size);
+    unsigned long calls = 0;
+    double start = now_ns();
+    for (unsigned i = 0; i < DUMPS; i++) {
+        size_t pos = 0;
+        do {
+            calls++;
+        } while (read_fn(dev, dst, read_size, &pos) > 0);
+    }
+    double elapsed = now_ns() - start;
+    printf(
+        "%-12s %6zu %10zu %12lu %14.0f\n",
+        variant,
+        aesd_circular_buffer_count(&dev->buf),
+        read_size,
+        calls / DUMPS,
+        elapsed / DUMPS
+    );
+    free(dst);
+}
+
+static int run_model(void)
+{
+    static const size_t depths[] = {10, 100, 1000, 10000};
+    static char record[RECORD_SIZE];
+    memset(record, 'r', sizeof(record));
+    record[RECORD_SIZE - 1] = '\n';
+
+    printf("%-12s %6s %10s %12s %14s\n", "variant", "depth", "read size", "calls/dump", "ns/dump");
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        struct model_dev dev;
+        size_t capacity = aesd_circular_buffer_capacity_for_depth(depths[d]);
+        struct aesd_buffer_entry *storage = calloc(capacity, sizeof(*storage));
+        aesd_circular_buffer_init(&dev.buf);
+        aesd_circular_buffer_resize(&dev.buf, storage, capacity, depths[d]);
+        pthread_mutex_init(&dev.buf_lock, NULL);
+        memset(&dev.cursor, 0, sizeof(dev.cursor));
+        struct aesd_buffer_entry entry = {.buffptr = record, .size = RECORD_SIZE};
+        for (size_t i = 0; i < depths[d]; i++) {
+            aesd_circular_buffer_add_entry(&dev.buf, &entry);
+        }
+
+        size_t history_size = aesd_circular_buffer_size(&dev.buf);
+        bench_model(&dev, "per-entry", read_per_entry, SOCKET_READ_SIZE);
+        bench_model(&dev, "multi-entry", read_multi_entry, SOCKET_READ_SIZE);
+        bench_model(&dev, "cursor", read_cursor, SOCKET_READ_SIZE);
+        bench_model(&dev, "per-entry", read_per_entry, history_size);
+        bench_model(&dev, "multi-entry", read_multi_entry, history_size);
+        bench_model(&dev, "cursor", read_cursor, history_size);
+
+        pthread_mutex_destroy(&dev.buf_lock);
+        free(storage);
+    }
+    return 0;
+}
+
+/** @brief  One thread dumping a device, and the totals it counted. */
+struct device_reader
+{
+    pthread_t thread;
+    const char *path;
+    size_t read_size;
+    unsigned long calls;
+    size_t bytes;
+    int error;
+};
+
+/**
+ * @brief   Dump the whole history of a device DUMPS times, opening it anew for each dump.
+ */
+static void *device_reader_main(void *arg)
+{
+    struct device_reader *reader = arg;
+    char *dst = malloc(reader->read_size);
+    for (unsigned i = 0; i < DUMPS && reader->error == 0; i++) {
+        int fd = open(reader->path, O_RDONLY);
+        if (fd < 0) {
+            reader->error = errno;
+            break;
+        }
+        ssize_t n;
+        do {
+            reader->calls++;
+            n = read(fd, dst, reader->read_size);
+            if (n > 0) {
+                reader->bytes += (size_t)n;
+            }
+        } while (n > 0);
+        if (n < 0) {
+            reader->error = errno;
+        }
+        close(fd);
+    }
+    free(dst);
+    return NULL;
+}
+
+/**
+ * @brief   Time DUMPS full-history dumps of @param path on each of @param threads threads at once.
+ */
+static int bench_device(const char *path, size_t read_size, int threads)
+{
+    struct device_reader *readers = calloc((size_t)threads, sizeof(*readers));
+    double start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        readers[i].path = path;
+        readers[i].read_size = read_size;
+        pthread_create(&readers[i].thread, NULL, device_reader_main, &readers[i]);
+    }
+    unsigned long calls = 0;
+    size_t bytes = 0;
+    int error = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(readers[i].thread, NULL);
+        calls += readers[i].calls;
+        bytes += readers[i].bytes;
+        if (readers[i].error != 0) {
+            error = readers[i].error;
+        }
+    }
+    double elapsed = now_ns() - start;
+    free(readers);
+    if (error != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(error));
+        return 1;
+    }
+    unsigned long dumps = (unsigned long)threads * DUMPS;
+    printf(
+        "%7d %10zu %12zu %12lu %14.0f %12.0f\n",
+        threads,
+        read_size,
+        bytes / dumps,
+        calls / dumps,
+        elapsed / DUMPS,
+        dumps / (elapsed / 1e9)
+    );
+    return 0;
+}
+
+static int run_device(const char *path, size_t read_size, int max_threads)
+{
+    printf(
+        "%7s %10s %12s %12s %14s %12s\n",
+        "threads", "read size", "bytes/dump", "calls/dump", "ns/dump", "dumps/s"
+    );
+    int threads = 1;
+    for (;;) {
+        if (bench_device(path, read_size, threads) != 0) {
+            return 1;
+        }
+        if (threads == max_threads) {
+            return 0;
+        }
+        threads = threads * 2 < max_threads ? threads * 2 : max_threads;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = NULL;
+    size_t read_size = SOCKET_READ_SIZE;
+    int threads = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--device") == 0 && i + 1 < argc) {
+            device = argv[++i];
+        } else if (strcmp(argv[i], "--read-size") == 0 && i + 1 < argc) {
+            read_size = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else {
+            fprintf(
+                stderr,
+                "usage: %s [--device PATH [--threads N]] [--read-size BYTES]\n",
+                argv[0]
+            );
+            return 1;
+        }
+    }
+    if (read_size == 0) {
+        fprintf(stderr, "read size must be positive\n");
+        return 1;
+    }
+    if (threads <= 0) {
+        fprintf(stderr, "thread count must be positive\n");
+        return 1;
+    }
+    return device != NULL ? run_device(device, read_size, threads) : run_model();
+}
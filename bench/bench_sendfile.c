@@ -0,0 +1,261 @@
+/**
+ * @file    bench_sendfile.c
+ * @brief   Throughput and CPU per request of sending a deep history to a socket, read+send
+ *          against sendfile.
+ *
+ * Each request sends the whole history from the start of the file to a TCP connection over the
+ * loopback interface, drained by another thread. The read+send variant copies it through a user
+ * buffer of the given size, as aesdsocket did, the sendfile variant lets the kernel move it. CPU
+ * per request is the CPU time of the sending thread, system time included.
+ *
+ * Without --device, the history is a temporary file holding --records lines. With --device, the
+ * lines are written to a loaded aesdchar device first, so the module should be loaded with a
+ * depth or arena large enough to keep them, and with follow=0 so reads stop at the end of data.
+ *
+ * Usage: bench_sendfile [--device PATH] [--records N] [--read-size BYTES]
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/** @brief  Size of each line of the history, including its newline. */
+#define RECORD_SIZE 64U
+/** @brief  Default number of lines in the history. */
+#define RECORDS 10000U
+/** @brief  Read size used by aesdsocket. */
+#define SOCKET_READ_SIZE 256U
+/** @brief  Maximum bytes moved by one sendfile() call, as in aesdsocket. */
+#define SENDFILE_CHUNK_SIZE (1U << 20)
+/** @brief  Whole-history requests timed per variant. */
+#define REQUESTS 200U
+
+/** @brief  Receiving end of the connection, discarding everything sent to it. */
+struct drain
+{
+    pthread_t thread;
+    int fd;
+    size_t bytes;
+};
+
+static double now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void *drain_main(void *arg)
+{
+    struct drain *drain = arg;
+    static char buf[1 << 16];
+    ssize_t n;
+    while ((n = recv(drain->fd, buf, sizeof(buf), 0)) > 0) {
+        drain->bytes += (size_t)n;
+    }
+    return NULL;
+}
+
+/**
+ * @brief   Connect @param send_fd to a new drain thread over the loopback interface.
+ * @return  0 on success, -1 on failure.
+ */
+static int connect_drain(struct drain *drain, int *send_fd)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (
+        listen_fd < 0
+            || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || listen(listen_fd, 1) != 0
+            || getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) != 0
+    ) {
+        perror("listen");
+        return -1;
+    }
+    *send_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (*send_fd < 0 || connect(*send_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        return -1;
+    }
+    drain->fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    if (drain->fd < 0) {
+        perror("accept");
+        return -1;
+    }
+    drain->bytes = 0;
+    pthread_create(&drain->thread, NULL, drain_main, drain);
+    return 0;
+}
+
+/**
+ * @brief   Send the whole file from its start to @param sock_fd through a user buffer.
+ * @return  The number of bytes sent, or -1 on failure.
+ */
+static ssize_t send_read(int file_fd, int sock_fd, char *buf, size_t read_size)
+{
+    size_t sent = 0;
+    ssize_t n;
+    while ((n = read(file_fd, buf, read_size)) > 0) {
+        if (send(sock_fd, buf, (size_t)n, 0) != n) {
+            return -1;
+        }
+        sent += (size_t)n;
+    }
+    return n < 0 ? -1 : (ssize_t)sent;
+}
+
+/**
+ * @brief   Send the whole file from its start to @param sock_fd with sendfile().
+ * @return  The number of bytes sent, or -1 on failure.
+ */
+static ssize_t send_sendfile(int file_fd, int sock_fd, char *buf, size_t read_size)
+{
+    (void)buf;
+    (void)read_size;
+    size_t sent = 0;
+    ssize_t n;
+    while ((n = sendfile(sock_fd, file_fd, NULL, SENDFILE_CHUNK_SIZE)) > 0) {
+        sent += (size_t)n;
+    }
+    return n < 0 ? -1 : (ssize_t)sent;
+}
+
+/**
+ * @brief   Time REQUESTS whole-history requests of @param path sent with @param send_fn.
+ */
+static int bench_variant(
+    const char *path,
+    const char *variant,
+    ssize_t (*send_fn)(int, int, char *, size_t),
+    size_t read_size
+) {
+    struct drain drain;
+    int sock_fd = -1;
+    if (connect_drain(&drain, &sock_fd) != 0) {
+        return 1;
+    }
+    int file_fd = open(path, O_RDONLY);
+    if (file_fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    char *buf = malloc(read_size);
+    size_t bytes = 0;
+    int result = 0;
+    double start = now_ns(CLOCK_MONOTONIC);
+    double start_cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+    for (unsigned i = 0; i < REQUESTS; i++) {
+        ssize_t sent = lseek(file_fd, 0, SEEK_SET) == 0
+            ? send_fn(file_fd, sock_fd, buf, read_size)
+            : -1;
+        if (sent < 0) {
+            fprintf(stderr, "%s %s: %s\n", path, variant, strerror(errno));
+            result = 1;
+            break;
+        }
+        bytes += (size_t)sent;
+    }
+    double cpu = now_ns(CLOCK_THREAD_CPUTIME_ID) - start_cpu;
+    // Wait for the drain to receive everything, so the elapsed time covers delivery too
+    shutdown(sock_fd, SHUT_WR);
+    pthread_join(drain.thread, NULL);
+    double elapsed = now_ns(CLOCK_MONOTONIC) - start;
+    close(drain.fd);
+    close(sock_fd);
+    close(file_fd);
+    free(buf);
+    if (result == 0) {
+        printf(
+            "%-10s %10zu %14zu %12.1f %16.1f\n",
+            variant,
+            read_size,
+            bytes / REQUESTS,
+            drain.bytes / (elapsed / 1e9) / 1e6,
+            cpu / REQUESTS / 1e3
+        );
+    }
+    return result;
+}
+
+/**
+ * @brief   Append @param records lines of RECORD_SIZE bytes to @param fd.
+ * @return  0 on success, -1 on failure.
+ */
+static int write_history(int fd, unsigned records)
+{
+    char line[RECORD_SIZE];
+    memset(line, 'r', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\n';
+    for (unsigned i = 0; i < records; i++) {
+        if (write(fd, line, sizeof(line)) != (ssize_t)sizeof(line)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = NULL;
+    unsigned records = RECORDS;
+    size_t read_size = SOCKET_READ_SIZE;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--device") == 0 && i + 1 < argc) {
+            device = argv[++i];
+        } else if (strcmp(argv[i], "--records") == 0 && i + 1 < argc) {
+            records = (unsigned)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--read-size") == 0 && i + 1 < argc) {
+            read_size = strtoul(argv[++i], NULL, 0);
+        } else {
+            fprintf(
+                stderr,
+                "usage: %s [--device PATH] [--records N] [--read-size BYTES]\n",
+                argv[0]
+            );
+            return 1;
+        }
+    }
+    if (read_size == 0) {
+        fprintf(stderr, "read size must be positive\n");
+        return 1;
+    }
+
+    char tmp_path[] = "/tmp/bench_sendfile.XXXXXX";
+    const char *path = device;
+    int fd = device != NULL ? open(device, O_WRONLY) : mkstemp(tmp_path);
+    if (device == NULL) {
+        path = tmp_path;
+    }
+    if (fd < 0 || write_history(fd, records) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    close(fd);
+
+    printf(
+        "%-10s %10s %14s %12s %16s\n",
+        "variant", "read size", "bytes/request", "MB/s", "cpu us/request"
+    );
+    int result = bench_variant(path, "read+send", send_read, read_size);
+    if (result == 0) {
+        result = bench_variant(path, "sendfile", send_sendfile, read_size);
+    }
+    if (device == NULL) {
+        unlink(tmp_path);
+    }
+    return result;
+}
@@ -0,0 +1,147 @@
+/**
+ * @file    bench_seqlock.c
+ * @brief   Throughput of the seqlock circular buffer against the same buffer behind a mutex.
+ *
+ * One producer appends fixed size records while a number of reader threads copy out the whole
+ * history, for a fixed duration per configuration. The mutex variant serializes every append
+ * and read on a single pthread mutex, the way a caller of the plain circular buffer would.
+ *
+ * Usage: bench_seqlock [seconds per run]
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-circular-buffer-seqlock.h"
+
+/** @brief  Size of each appended record in bytes. */
+#define RECORD_SIZE 64U
+/** @brief  Number of records retained. */
+#define DEPTH 256U
+/** @brief  Arena size in bytes, large enough to hold DEPTH records. */
+#define ARENA_SIZE (DEPTH * RECORD_SIZE)
+/** @brief  Largest number of reader threads benchmarked. */
+#define MAX_READERS 8
+
+/** @brief  State shared by the producer and readers of one run. */
+struct bench_run
+{
+    struct aesd_seqlock_buffer sb;
+    /** @brief  If `true`, every buffer operation takes `lock` first. */
+    bool use_mutex;
+    pthread_mutex_t lock;
+    atomic_bool stop;
+    atomic_ulong appends;
+    atomic_ulong reads;
+};
+
+static void *producer_main(void *arg)
+{
+    struct bench_run *run = arg;
+    char record[RECORD_SIZE];
+    memset(record, 'p', sizeof(record));
+    record[RECORD_SIZE - 1] = '\n';
+    unsigned long appends = 0;
+    while (!atomic_load_explicit(&run->stop, memory_order_relaxed)) {
+        if (run->use_mutex) {
+            pthread_mutex_lock(&run->lock);
+        }
+        aesd_seqlock_buffer_append(&run->sb, record, sizeof(record));
+        if (run->use_mutex) {
+            pthread_mutex_unlock(&run->lock);
+        }
+        appends++;
+    }
+    atomic_store(&run->appends, appends);
+    return NULL;
+}
+
+static void *reader_main(void *arg)
+{
+    struct bench_run *run = arg;
+    char *snapshot = malloc(ARENA_SIZE);
+    unsigned long reads = 0;
+    while (!atomic_load_explicit(&run->stop, memory_order_relaxed)) {
+        if (run->use_mutex) {
+            pthread_mutex_lock(&run->lock);
+        }
+        aesd_seqlock_buffer_read(&run->sb, 0, snapshot, ARENA_SIZE);
+        if (run->use_mutex) {
+            pthread_mutex_unlock(&run->lock);
+        }
+        reads++;
+    }
+    atomic_fetch_add(&run->reads, reads);
+    free(snapshot);
+    return NULL;
+}
+
+/**
+ * @brief   Run one configuration and print its throughput.
+ */
+static int bench(bool use_mutex, int readers, double seconds)
+{
+    static struct bench_run run;
+    if (aesd_seqlock_buffer_init(&run.sb, DEPTH, ARENA_SIZE)) {
+        fprintf(stderr, "buffer init failed\n");
+        return -1;
+    }
+    run.use_mutex = use_mutex;
+    pthread_mutex_init(&run.lock, NULL);
+    atomic_init(&run.stop, false);
+    atomic_init(&run.appends, 0);
+    atomic_init(&run.reads, 0);
+
+    pthread_t producer;
+    pthread_t reader_tids[MAX_READERS];
+    pthread_create(&producer, NULL, producer_main, &run);
+    for (int i = 0; i < readers; i++) {
+        pthread_create(&reader_tids[i], NULL, reader_main, &run);
+    }
+
+    struct timespec duration = {
+        .tv_sec = (time_t)seconds,
+        .tv_nsec = (long)((seconds - (double)(time_t)seconds) * 1e9),
+    };
+    nanosleep(&duration, NULL);
+    atomic_store(&run.stop, true);
+    pthread_join(producer, NULL);
+    for (int i = 0; i < readers; i++) {
+        pthread_join(reader_tids[i], NULL);
+    }
+
+    printf(
+        "%-8s %7d %14.0f %14.0f\n",
+        use_mutex ? "mutex" : "seqlock",
+        readers,
+        (double)atomic_load(&run.appends) / seconds,
+        (double)atomic_load(&run.reads) / seconds
+    );
+    pthread_mutex_destroy(&run.lock);
+    aesd_seqlock_buffer_destroy(&run.sb);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    if (seconds <= 0) {
+        fprintf(stderr, "usage: %s [seconds per run]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-8s %7s %14s %14s\n", "variant", "readers", "appends/s", "snapshots/s");
+    for (int readers = 1; readers <= MAX_READERS; readers *= 2) {
+        if (bench(false, readers, seconds) || bench(true, readers, seconds)) {
+            return 1;
+        }
+    }
+    return 0;
+}
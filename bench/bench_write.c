@@ -0,0 +1,147 @@
+/**
+ * @file    bench_write.c
+ * @brief   Aggregate line throughput of writers to a loaded aesdchar device against thread count.
+ *
+ * Runs 1, 2, 4 and so on up to the given number of threads at once, each writing lines of the
+ * given size through its own file, so the scaling of ingest with the number of cores writing can
+ * be compared between a module loaded with sharded=0 and one loaded with sharded=1.
+ *
+ * Usage: bench_write --device PATH [--threads N] [--line-size BYTES]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** @brief  Default size of each line written, including its newline. */
+#define LINE_SIZE 64U
+/** @brief  Lines written by each thread per configuration. */
+#define LINES 100000U
+
+/** @brief  One thread writing to a device, and the error it stopped on. */
+struct device_writer
+{
+    pthread_t thread;
+    const char *path;
+    size_t line_size;
+    int error;
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/**
+ * @brief   Write LINES lines to a device through one file.
+ */
+static void *device_writer_main(void *arg)
+{
+    struct device_writer *writer = arg;
+    char *line = malloc(writer->line_size);
+    memset(line, 'w', writer->line_size - 1);
+    line[writer->line_size - 1] = '\n';
+    int fd = open(writer->path, O_WRONLY);
+    if (fd < 0) {
+        writer->error = errno;
+    }
+    for (unsigned i = 0; i < LINES && writer->error == 0; i++) {
+        if (write(fd, line, writer->line_size) != (ssize_t)writer->line_size) {
+            writer->error = errno != 0 ? errno : EIO;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(line);
+    return NULL;
+}
+
+/**
+ * @brief   Time LINES writes of @param line_size bytes to @param path on each of @param threads
+ *          threads at once.
+ */
+static int bench_device(const char *path, size_t line_size, int threads)
+{
+    struct device_writer *writers = calloc((size_t)threads, sizeof(*writers));
+    double start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        writers[i].path = path;
+        writers[i].line_size = line_size;
+        pthread_create(&writers[i].thread, NULL, device_writer_main, &writers[i]);
+    }
+    int error = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(writers[i].thread, NULL);
+        if (writers[i].error != 0) {
+            error = writers[i].error;
+        }
+    }
+    double elapsed = now_ns() - start;
+    free(writers);
+    if (error != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(error));
+        return 1;
+    }
+    unsigned long lines = (unsigned long)threads * LINES;
+    printf(
+        "%7d %10zu %12.0f %12.0f\n",
+        threads,
+        line_size,
+        elapsed / lines,
+        lines / (elapsed / 1e9)
+    );
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = NULL;
+    size_t line_size = LINE_SIZE;
+    int max_threads = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--device") == 0 && i + 1 < argc) {
+            device = argv[++i];
+        } else if (strcmp(argv[i], "--line-size") == 0 && i + 1 < argc) {
+            line_size = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            max_threads = atoi(argv[++i]);
+        } else {
+            device = NULL;
+            break;
+        }
+    }
+    if (device == NULL) {
+        fprintf(stderr, "usage: %s --device PATH [--threads N] [--line-size BYTES]\n", argv[0]);
+        return 1;
+    }
+    if (line_size == 0) {
+        fprintf(stderr, "line size must be positive\n");
+        return 1;
+    }
+    if (max_threads <= 0) {
+        fprintf(stderr, "thread count must be positive\n");
+        return 1;
+    }
+
+    printf("%7s %10s %12s %12s\n", "threads", "line size", "ns/line", "lines/s");
+    int threads = 1;
+    for (;;) {
+        if (bench_device(device, line_size, threads) != 0) {
+            return 1;
+        }
+        if (threads == max_threads) {
+            return 0;
+        }
+        threads = threads * 2 < max_threads ? threads * 2 : max_threads;
+    }
+}
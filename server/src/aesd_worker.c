@@ -3,9 +3,13 @@
 
 #include <fcntl.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <syslog.h>
 #include <unistd.h>
 
+/** @brief  Maximum number of bytes moved by one `sendfile()` call, so shutdown is noticed. */
+#define SENDFILE_CHUNK_SIZE (1U << 20)
+
 /**
  * @brief   Receive data from the client and append it to the output file.
  *
@@ -80,7 +84,9 @@ out:
 /**
  * @brief   Send back the current data in the output file to the client.
  *
- * The output file should be opened in RW mode to enable readback in this function.
+ * The output file should be opened in RW mode to enable readback in this function. The data is
+ * moved with `sendfile()` so it doesn't pass through user space, falling back to reads into the
+ * worker buffer if the output file doesn't support it.
  *
  * @param   self
  *
@@ -92,7 +98,22 @@ static bool send_response(struct aesd_worker *self, int output_fd)
 
     // Loop until the entire response has been sent
     bool done = false;
+    bool use_sendfile = true;
     while (!done && !self->shutdown) {
+        if (use_sendfile) {
+            ssize_t n = sendfile(self->client_fd, output_fd, NULL, SENDFILE_CHUNK_SIZE);
+            if (-1 == n && (EINVAL == errno || ENOSYS == errno)) {
+                use_sendfile = false;
+            }
+            else if (-1 == n) {
+                perror("worker sendfile");
+                goto out;
+            }
+            else if (0 == n) {
+                done = true;
+            }
+            continue;
+        }
         ssize_t n = read(output_fd, self->buf_, self->buf_size_);
         if (-1 == n) {
             perror("worker read");
@@ -0,0 +1,146 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static const char *strings[] = {
+    "write0\n", "write1\n", "write2\n", "write3\n", "write4\n", "write5\n", "write6\n",
+    "write7\n", "write8\n", "write9\n", "write10\n", "write11\n", "write12\n", "write13\n",
+};
+
+#define STRING_COUNT (sizeof(strings) / sizeof(strings[0]))
+
+static void fill_entries(struct aesd_buffer_entry *entries, size_t first, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        entries[i].buffptr = strings[first + i];
+        entries[i].size = strlen(strings[first + i]);
+        entries[i].stamp = 0;
+    }
+}
+
+void test_circular_buffer_batch_insert()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    struct aesd_buffer_entry entries[STRING_COUNT];
+    const char *evicted[STRING_COUNT];
+
+    // Nothing is evicted while the batch fits within the depth
+    fill_entries(entries, 0, 4);
+    size_t evicted_count = STRING_COUNT;
+    TEST_ASSERT_EQUAL(4, aesd_circular_buffer_add_entries(
+        &buffer, entries, 4, evicted, &evicted_count
+    ));
+    TEST_ASSERT_EQUAL(0, evicted_count);
+    TEST_ASSERT_EQUAL(4, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL(28, aesd_circular_buffer_size(&buffer));
+
+    // Overflowing the depth returns every dropped buffer, oldest first
+    fill_entries(entries, 4, STRING_COUNT - 4);
+    evicted_count = STRING_COUNT;
+    TEST_ASSERT_EQUAL(STRING_COUNT - 4, aesd_circular_buffer_add_entries(
+        &buffer, entries, STRING_COUNT - 4, evicted, &evicted_count
+    ));
+    TEST_ASSERT_EQUAL(STRING_COUNT - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, evicted_count);
+    for (size_t i = 0; i < evicted_count; i++) {
+        TEST_ASSERT_EQUAL_PTR(strings[i], evicted[i]);
+    }
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_EQUAL(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, aesd_circular_buffer_count(&buffer));
+    for (size_t i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry_at_out_index(&buffer, i);
+        TEST_ASSERT_EQUAL_PTR(strings[evicted_count + i], entry->buffptr);
+    }
+}
+
+void test_circular_buffer_batch_larger_than_depth()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    struct aesd_buffer_entry entries[STRING_COUNT];
+    const char *evicted[STRING_COUNT];
+
+    // Entries from the batch itself are evicted by later entries of the same batch
+    fill_entries(entries, 0, STRING_COUNT);
+    size_t evicted_count = STRING_COUNT;
+    TEST_ASSERT_EQUAL(STRING_COUNT, aesd_circular_buffer_add_entries(
+        &buffer, entries, STRING_COUNT, evicted, &evicted_count
+    ));
+    TEST_ASSERT_EQUAL(STRING_COUNT - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, evicted_count);
+    TEST_ASSERT_EQUAL_PTR(strings[0], evicted[0]);
+
+    size_t offset_rtn = 0;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+        &buffer, 0, &offset_rtn
+    );
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_PTR(strings[evicted_count], entry->buffptr);
+}
+
+void test_circular_buffer_batch_evicted_overflow()
+{
+    static char data[100];
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    buffer.max_bytes = 100;
+    struct aesd_buffer_entry entries[5];
+    const char *evicted[2];
+
+    for (size_t i = 0; i < 5; i++) {
+        entries[i].buffptr = data + i;
+        entries[i].size = 20;
+        entries[i].stamp = 0;
+    }
+    size_t evicted_count = 2;
+    TEST_ASSERT_EQUAL(5, aesd_circular_buffer_add_entries(
+        &buffer, entries, 5, evicted, &evicted_count
+    ));
+    TEST_ASSERT_EQUAL(0, evicted_count);
+
+    // A large entry needs four evictions but only two fit, so the insert stops before it
+    struct aesd_buffer_entry big = {.buffptr = data + 50, .size = 80, .stamp = 0};
+    evicted_count = 2;
+    TEST_ASSERT_EQUAL(0, aesd_circular_buffer_add_entries(
+        &buffer, &big, 1, evicted, &evicted_count
+    ));
+    TEST_ASSERT_EQUAL(2, evicted_count);
+    TEST_ASSERT_EQUAL_PTR(data + 0, evicted[0]);
+    TEST_ASSERT_EQUAL_PTR(data + 1, evicted[1]);
+    TEST_ASSERT_EQUAL(3, aesd_circular_buffer_count(&buffer));
+
+    // Retrying once the evicted data is dealt with finishes the insert
+    evicted_count = 2;
+    TEST_ASSERT_EQUAL(1, aesd_circular_buffer_add_entries(
+        &buffer, &big, 1, evicted, &evicted_count
+    ));
+    TEST_ASSERT_EQUAL(2, evicted_count);
+    TEST_ASSERT_EQUAL_PTR(data + 2, evicted[0]);
+    TEST_ASSERT_EQUAL_PTR(data + 3, evicted[1]);
+    TEST_ASSERT_EQUAL(2, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL(100, aesd_circular_buffer_size(&buffer));
+}
+
+void test_circular_buffer_batch_max_age()
+{
+    static char data[10];
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    buffer.max_age = 10;
+    struct aesd_buffer_entry entries[3] = {
+        {.buffptr = data, .size = 1, .stamp = 0},
+        {.buffptr = data + 1, .size = 1, .stamp = 5},
+        {.buffptr = data + 2, .size = 1, .stamp = 12},
+    };
+    const char *evicted[3];
+
+    // Each entry's stamp is the current time, so the first entry expires within the batch
+    size_t evicted_count = 3;
+    TEST_ASSERT_EQUAL(3, aesd_circular_buffer_add_entries(
+        &buffer, entries, 3, evicted, &evicted_count
+    ));
+    TEST_ASSERT_EQUAL(1, evicted_count);
+    TEST_ASSERT_EQUAL_PTR(data, evicted[0]);
+    TEST_ASSERT_EQUAL(2, aesd_circular_buffer_count(&buffer));
+}
@@ -0,0 +1,156 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static void add_string(struct aesd_circular_buffer *buffer, const char *str)
+{
+    struct aesd_buffer_entry entry = {.buffptr = str, .size = strlen(str)};
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+ * @return  The number of bytes of @param buffer from @param offs gathered into @param dst, read
+ *          @param count bytes at a time through @param cursor.
+ */
+static size_t read_all(
+    struct aesd_circular_buffer *buffer,
+    struct aesd_buffer_cursor *cursor,
+    size_t offs,
+    size_t count,
+    char *dst
+) {
+    struct iovec iov[4];
+    size_t total = 0;
+    size_t bytes;
+    do {
+        size_t iov_count = aesd_circular_buffer_fill_iovec_cursor(
+            buffer, cursor, offs + total, count, iov, 4, &bytes
+        );
+        for (size_t i = 0; i < iov_count; i++) {
+            memcpy(dst + total, iov[i].iov_base, iov[i].iov_len);
+            total += iov[i].iov_len;
+        }
+    } while (bytes > 0);
+    return total;
+}
+
+void test_circular_buffer_cursor_sequential()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    add_string(&buffer, "first\n");
+    add_string(&buffer, "second\n");
+    add_string(&buffer, "third\n");
+
+    struct aesd_buffer_cursor cursor = {0};
+    struct iovec iov[4];
+    size_t bytes = 0;
+
+    // A range ending mid-entry leaves the cursor inside that entry
+    TEST_ASSERT_EQUAL(2, aesd_circular_buffer_fill_iovec_cursor(
+        &buffer, &cursor, 0, 9, iov, 4, &bytes
+    ));
+    TEST_ASSERT_EQUAL(9, bytes);
+    TEST_ASSERT_EQUAL(1, cursor.slot);
+    TEST_ASSERT_EQUAL(3, cursor.offset);
+    TEST_ASSERT_EQUAL(6, cursor.stream_offs);
+
+    // Continuing from the cursor describes the rest, ending at the slot of the next entry
+    TEST_ASSERT_EQUAL(2, aesd_circular_buffer_fill_iovec_cursor(
+        &buffer, &cursor, 9, 100, iov, 4, &bytes
+    ));
+    TEST_ASSERT_EQUAL(10, bytes);
+    TEST_ASSERT_EQUAL_MEMORY("ond\n", iov[0].iov_base, 4);
+    TEST_ASSERT_EQUAL_MEMORY("third\n", iov[1].iov_base, 6);
+    TEST_ASSERT_EQUAL(3, cursor.slot);
+    TEST_ASSERT_EQUAL(0, cursor.offset);
+    TEST_ASSERT_EQUAL(19, cursor.stream_offs);
+
+    // Nothing past the end of data, and the cursor waits for the next entry
+    TEST_ASSERT_EQUAL(0, aesd_circular_buffer_fill_iovec_cursor(
+        &buffer, &cursor, 19, 100, iov, 4, &bytes
+    ));
+    TEST_ASSERT_EQUAL(3, cursor.slot);
+    add_string(&buffer, "fourth\n");
+    TEST_ASSERT_EQUAL(1, aesd_circular_buffer_fill_iovec_cursor(
+        &buffer, &cursor, 19, 100, iov, 4, &bytes
+    ));
+    TEST_ASSERT_EQUAL(7, bytes);
+    TEST_ASSERT_EQUAL_MEMORY("fourth\n", iov[0].iov_base, 7);
+
+    // A cursor describing another position is ignored
+    TEST_ASSERT_EQUAL(1, aesd_circular_buffer_fill_iovec_cursor(
+        &buffer, &cursor, 2, 3, iov, 4, &bytes
+    ));
+    TEST_ASSERT_EQUAL_MEMORY("rst", iov[0].iov_base, 3);
+}
+
+void test_circular_buffer_cursor_eviction()
+{
+    static const char *strings[] = {
+        "a\n", "bb\n", "ccc\n", "dddd\n", "eeeee\n", "ffffff\n", "ggggggg\n", "hhhhhhhh\n",
+    };
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    for (size_t i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        add_string(&buffer, strings[i % 8]);
+    }
+
+    // Leave a cursor in the oldest entry, then wrap the ring so its slot holds a newer entry
+    struct aesd_buffer_cursor cursor = {0};
+    struct iovec iov[4];
+    size_t bytes = 0;
+    aesd_circular_buffer_fill_iovec_cursor(&buffer, &cursor, 0, 1, iov, 4, &bytes);
+    TEST_ASSERT_EQUAL(0, cursor.slot);
+    for (size_t i = 0; i < AESDCHAR_INLINE_CAPACITY; i++) {
+        add_string(&buffer, strings[(i + 3) % 8]);
+    }
+    TEST_ASSERT_NOT_NULL(buffer.entry[0].buffptr);
+
+    // Reading through the stale cursor gives the same data as reading without one
+    char expected[128];
+    char out[128];
+    struct aesd_buffer_cursor none = {0};
+    size_t expected_size = read_all(&buffer, &none, 1, 1000, expected);
+    TEST_ASSERT_EQUAL(expected_size, read_all(&buffer, &cursor, 1, 1000, out));
+    TEST_ASSERT_EQUAL_MEMORY(expected, out, expected_size);
+
+    // Small reads continuing from the cursor walk the whole history
+    cursor = none;
+    TEST_ASSERT_EQUAL(aesd_circular_buffer_size(&buffer), read_all(&buffer, &cursor, 0, 3, out));
+    TEST_ASSERT_EQUAL_MEMORY(expected, out + 1, expected_size);
+}
+
+void test_circular_buffer_cursor_resize()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    for (size_t i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3; i++) {
+        add_string(&buffer, i % 2 ? "odd\n" : "even\n");
+    }
+
+    // Moving the entries to new storage puts other entries in the slot of the cursor
+    struct aesd_buffer_cursor cursor = {0};
+    struct iovec iov[4];
+    size_t bytes = 0;
+    aesd_circular_buffer_fill_iovec_cursor(&buffer, &cursor, 0, 6, iov, 4, &bytes);
+    TEST_ASSERT_EQUAL(4, cursor.slot);
+    TEST_ASSERT_EQUAL(2, cursor.offset);
+    struct aesd_buffer_entry *storage = calloc(32, sizeof(*storage));
+    TEST_ASSERT_NULL(aesd_circular_buffer_resize(&buffer, storage, 32, 20));
+    TEST_ASSERT_TRUE(cursor.stream_offs != buffer.entry[4].stream_offs);
+
+    // The cursor no longer matches, so the position is searched for instead
+    TEST_ASSERT_EQUAL(3, aesd_circular_buffer_fill_iovec_cursor(
+        &buffer, &cursor, 6, 8, iov, 4, &bytes
+    ));
+    TEST_ASSERT_EQUAL(8, bytes);
+    TEST_ASSERT_EQUAL_MEMORY("en\n", iov[0].iov_base, 3);
+    TEST_ASSERT_EQUAL_MEMORY("odd\n", iov[1].iov_base, 4);
+    TEST_ASSERT_EQUAL_MEMORY("e", iov[2].iov_base, 1);
+    TEST_ASSERT_EQUAL(3, cursor.slot);
+    TEST_ASSERT_EQUAL(1, cursor.offset);
+    free(storage);
+}
@@ -0,0 +1,104 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+ * Write numbered packets "write<n>\n" into the buffer, starting at @param first.
+ */
+static void write_packets(
+    struct aesd_circular_buffer *buffer, char (*packets)[16], size_t first, size_t count
+) {
+    for (size_t i = first; i < first + count; i++) {
+        snprintf(packets[i], sizeof(packets[i]), "write%zu\n", i);
+        struct aesd_buffer_entry entry;
+        entry.buffptr = packets[i];
+        entry.size = strlen(packets[i]);
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+/**
+ * Verify the buffer holds exactly packets [first, first + count) in order.
+ */
+static void verify_packets(
+    struct aesd_circular_buffer *buffer, char (*packets)[16], size_t first, size_t count
+) {
+    TEST_ASSERT_EQUAL_MESSAGE(count, aesd_circular_buffer_count(buffer), "unexpected entry count");
+    size_t char_offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry_at_out_index(buffer, i);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "expected an entry at this index");
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(packets[first + i], entry->buffptr, "unexpected entry");
+        size_t entry_offset = 0;
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(
+            entry,
+            aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &entry_offset),
+            "lookup by offset should find the entry"
+        );
+        char_offset += entry->size;
+    }
+    TEST_ASSERT_NULL(aesd_circular_buffer_get_entry_at_out_index(buffer, count));
+    TEST_ASSERT_EQUAL(char_offset, aesd_circular_buffer_size(buffer));
+}
+
+void test_circular_buffer_depth_power_of_two()
+{
+    TEST_ASSERT_EQUAL(1, aesd_circular_buffer_capacity_for_depth(1));
+    TEST_ASSERT_EQUAL(16, aesd_circular_buffer_capacity_for_depth(10));
+    TEST_ASSERT_EQUAL(16, aesd_circular_buffer_capacity_for_depth(16));
+    TEST_ASSERT_EQUAL(32768, aesd_circular_buffer_capacity_for_depth(20000));
+}
+
+void test_circular_buffer_depth_grow_keeps_entries()
+{
+    static char packets[64][16];
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+
+    // Wrap the default depth so the entries don't start at slot zero
+    write_packets(&buffer, packets, 0, 13);
+    verify_packets(&buffer, packets, 3, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+
+    size_t capacity = aesd_circular_buffer_capacity_for_depth(40);
+    struct aesd_buffer_entry *storage = malloc(capacity * sizeof(*storage));
+    TEST_ASSERT_NULL(aesd_circular_buffer_resize(&buffer, storage, capacity, 40));
+    verify_packets(&buffer, packets, 3, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+
+    // Fill to the new depth and wrap again
+    write_packets(&buffer, packets, 13, 50);
+    TEST_ASSERT_TRUE(buffer.full);
+    verify_packets(&buffer, packets, 23, 40);
+
+    // Shrink back to the inline storage, dropping the oldest entries first
+    struct aesd_buffer_entry removed;
+    while (aesd_circular_buffer_count(&buffer) > 4) {
+        TEST_ASSERT_TRUE(aesd_circular_buffer_remove_entry(&buffer, &removed));
+    }
+    TEST_ASSERT_EQUAL_PTR(packets[58], removed.buffptr);
+    TEST_ASSERT_EQUAL_PTR(storage, aesd_circular_buffer_resize(&buffer, NULL, 0, 4));
+    free(storage);
+    TEST_ASSERT_TRUE(buffer.full);
+    verify_packets(&buffer, packets, 59, 4);
+}
+
+void test_circular_buffer_depth_eviction_clears_slots()
+{
+    static char packets[64][16];
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    write_packets(&buffer, packets, 0, 25);
+
+    // Only the retained entries should be visible when iterating every slot
+    size_t index = 0;
+    size_t valid = 0;
+    struct aesd_buffer_entry *entry = NULL;
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &buffer, index) {
+        if (entry->buffptr != NULL) {
+            valid++;
+        }
+    }
+    TEST_ASSERT_EQUAL(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, valid);
+}
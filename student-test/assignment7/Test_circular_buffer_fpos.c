@@ -0,0 +1,112 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+ * Reference implementation of the offset lookup, walking every entry from the output offset.
+ * This is the original linear search the cached prefix sums replace.
+ */
+static struct aesd_buffer_entry *linear_find_entry_offset_for_fpos(
+    struct aesd_circular_buffer *buffer, size_t char_offset, size_t *entry_offset_byte_rtn
+) {
+    size_t search_offset = 0;
+    struct aesd_buffer_entry *entry = NULL;
+    for (size_t i = 0; (entry = aesd_circular_buffer_get_entry_at_out_index(buffer, i)); i++) {
+        if (search_offset + entry->size > char_offset) {
+            *entry_offset_byte_rtn = char_offset - search_offset;
+            return entry;
+        }
+        search_offset += entry->size;
+    }
+    return NULL;
+}
+
+/**
+ * @return  The total buffer size computed by adding up every entry.
+ */
+static size_t linear_total_size(struct aesd_circular_buffer *buffer)
+{
+    size_t total_size = 0;
+    struct aesd_buffer_entry *entry = NULL;
+    for (size_t i = 0; (entry = aesd_circular_buffer_get_entry_at_out_index(buffer, i)); i++) {
+        total_size += entry->size;
+    }
+    return total_size;
+}
+
+/**
+ * Check every offset in the buffer, plus a few past the end, against the linear walk.
+ */
+static void verify_against_linear_walk(struct aesd_circular_buffer *buffer)
+{
+    size_t total_size = linear_total_size(buffer);
+    TEST_ASSERT_EQUAL_MESSAGE(
+        total_size, aesd_circular_buffer_size(buffer), "cached total size should match the sum"
+    );
+    for (size_t char_offset = 0; char_offset < total_size + 3; char_offset++) {
+        size_t expected_offset = 0;
+        size_t actual_offset = 0;
+        struct aesd_buffer_entry *expected = linear_find_entry_offset_for_fpos(
+            buffer, char_offset, &expected_offset
+        );
+        struct aesd_buffer_entry *actual = aesd_circular_buffer_find_entry_offset_for_fpos(
+            buffer, char_offset, &actual_offset
+        );
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(expected, actual, "lookup should find the same entry");
+        if (expected != NULL) {
+            TEST_ASSERT_EQUAL_MESSAGE(
+                expected_offset, actual_offset, "lookup should find the same entry offset"
+            );
+            TEST_ASSERT_EQUAL_MESSAGE(
+                char_offset - expected_offset,
+                aesd_circular_buffer_entry_fpos(buffer, actual),
+                "entry fpos should match the start of the entry"
+            );
+        }
+    }
+}
+
+void test_circular_buffer_fpos_empty()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    size_t offset = 0;
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &offset));
+    TEST_ASSERT_EQUAL(0, aesd_circular_buffer_size(&buffer));
+    TEST_ASSERT_EQUAL(0, aesd_circular_buffer_count(&buffer));
+}
+
+void test_circular_buffer_fpos_matches_linear_walk()
+{
+    static char data[64];
+    memset(data, 'x', sizeof(data));
+
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    srand(5305);
+
+    // Fill well past the point of wrapping several times, checking after every insert
+    for (int i = 0; i < 5 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        struct aesd_buffer_entry entry;
+        entry.buffptr = data;
+        entry.size = 1 + (size_t)rand() % (sizeof(data) - 1);
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+        verify_against_linear_walk(&buffer);
+    }
+}
+
+void test_circular_buffer_fpos_zero_sized_entries()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    const size_t sizes[] = {3, 0, 0, 5, 0, 1, 0, 0, 2, 0, 4, 0};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        struct aesd_buffer_entry entry;
+        entry.buffptr = "abcde";
+        entry.size = sizes[i];
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+        verify_against_linear_walk(&buffer);
+    }
+}
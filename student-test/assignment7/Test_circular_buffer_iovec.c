@@ -0,0 +1,148 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static void add_string(struct aesd_circular_buffer *buffer, const char *str)
+{
+    struct aesd_buffer_entry entry = {.buffptr = str, .size = strlen(str)};
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+ * @return  The number of bytes gathered from the @param iov_count vectors into @param dst.
+ */
+static size_t gather(const struct iovec *iov, size_t iov_count, char *dst)
+{
+    size_t offs = 0;
+    for (size_t i = 0; i < iov_count; i++) {
+        memcpy(dst + offs, iov[i].iov_base, iov[i].iov_len);
+        offs += iov[i].iov_len;
+    }
+    return offs;
+}
+
+void test_circular_buffer_iovec_range()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    add_string(&buffer, "first\n");
+    add_string(&buffer, "");
+    add_string(&buffer, "second\n");
+    add_string(&buffer, "third\n");
+
+    struct iovec iov[8];
+    char out[64];
+    size_t bytes = 0;
+
+    // A range starting mid-entry and ending mid-entry, skipping the empty entry
+    TEST_ASSERT_EQUAL(3, aesd_circular_buffer_fill_iovec(&buffer, 3, 12, iov, 8, &bytes));
+    TEST_ASSERT_EQUAL(12, bytes);
+    TEST_ASSERT_EQUAL(3, iov[0].iov_len);
+    TEST_ASSERT_EQUAL(7, iov[1].iov_len);
+    TEST_ASSERT_EQUAL(2, iov[2].iov_len);
+    TEST_ASSERT_EQUAL(12, gather(iov, 3, out));
+    TEST_ASSERT_EQUAL_MEMORY("st\nsecond\nth", out, 12);
+
+    // The whole history, clamped to the data available
+    TEST_ASSERT_EQUAL(3, aesd_circular_buffer_fill_iovec(&buffer, 0, 1000, iov, 8, &bytes));
+    TEST_ASSERT_EQUAL(19, bytes);
+    TEST_ASSERT_EQUAL(19, gather(iov, 3, out));
+    TEST_ASSERT_EQUAL_MEMORY("first\nsecond\nthird\n", out, 19);
+
+    // Running out of vectors truncates the range at the last one filled
+    TEST_ASSERT_EQUAL(2, aesd_circular_buffer_fill_iovec(&buffer, 0, 1000, iov, 2, &bytes));
+    TEST_ASSERT_EQUAL(13, bytes);
+
+    // Offsets past the end of data describe nothing
+    TEST_ASSERT_EQUAL(0, aesd_circular_buffer_fill_iovec(&buffer, 19, 10, iov, 8, &bytes));
+    TEST_ASSERT_EQUAL(0, bytes);
+}
+
+void test_circular_buffer_iovec_wrap()
+{
+    static const char *strings[] = {
+        "a\n", "bb\n", "ccc\n", "dddd\n", "eeeee\n", "ffffff\n", "ggggggg\n", "hhhhhhhh\n",
+    };
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+
+    // Wrap the slot ring around several times so the live entries straddle its end
+    for (size_t i = 0; i < 5 * AESDCHAR_INLINE_CAPACITY + 3; i++) {
+        add_string(&buffer, strings[i % 8]);
+    }
+    TEST_ASSERT_TRUE(buffer.out_offs > buffer.in_offs);
+
+    char expected[128];
+    size_t expected_size = 0;
+    for (size_t i = 0; i < aesd_circular_buffer_count(&buffer); i++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry_at_out_index(&buffer, i);
+        memcpy(expected + expected_size, entry->buffptr, entry->size);
+        expected_size += entry->size;
+    }
+
+    struct iovec iov[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    char out[128];
+    size_t bytes = 0;
+    for (size_t offs = 0; offs < expected_size; offs++) {
+        size_t count = aesd_circular_buffer_fill_iovec(
+            &buffer, offs, sizeof(out), iov, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, &bytes
+        );
+        TEST_ASSERT_TRUE(count > 0);
+        TEST_ASSERT_EQUAL(expected_size - offs, bytes);
+        TEST_ASSERT_EQUAL(bytes, gather(iov, count, out));
+        TEST_ASSERT_EQUAL_MEMORY(expected + offs, out, bytes);
+    }
+
+    // The vectors can be handed straight to writev()
+    int fds[2];
+    TEST_ASSERT_EQUAL(0, pipe(fds));
+    size_t count = aesd_circular_buffer_fill_iovec(
+        &buffer, 0, sizeof(out), iov, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, &bytes
+    );
+    TEST_ASSERT_EQUAL((ssize_t)bytes, writev(fds[1], iov, (int)count));
+    TEST_ASSERT_EQUAL((ssize_t)bytes, read(fds[0], out, sizeof(out)));
+    TEST_ASSERT_EQUAL_MEMORY(expected, out, bytes);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_circular_buffer_iovec_index_copy()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 4; i++) {
+        add_string(&buffer, i % 2 ? "odd\n" : "even\n");
+    }
+
+    // A copy of the index finds the same entries as the buffer it was taken from
+    struct aesd_buffer_index snap = buffer.index;
+    TEST_ASSERT_EQUAL(aesd_circular_buffer_count(&buffer), aesd_buffer_index_count(&snap));
+    for (size_t i = 0; i <= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        TEST_ASSERT_EQUAL_PTR(
+            aesd_circular_buffer_get_entry_at_out_index(&buffer, i),
+            aesd_buffer_index_get_entry_at_out_index(&snap, i)
+        );
+    }
+    size_t entry_offset = 0;
+    struct aesd_buffer_entry *entry = aesd_buffer_index_find_entry_offset_for_fpos(
+        &snap, 6, &entry_offset
+    );
+    TEST_ASSERT_EQUAL_PTR(aesd_circular_buffer_get_entry_at_out_index(&buffer, 1), entry);
+    TEST_ASSERT_EQUAL(1, entry_offset);
+    TEST_ASSERT_EQUAL(5, aesd_buffer_index_entry_fpos(&snap, entry));
+
+    struct iovec iov[8];
+    char expected[64];
+    char out[64];
+    size_t bytes = 0;
+    size_t expected_count = aesd_circular_buffer_fill_iovec(&buffer, 3, 20, iov, 8, &bytes);
+    size_t expected_size = gather(iov, expected_count, expected);
+    TEST_ASSERT_EQUAL(expected_count, aesd_buffer_index_fill_iovec_cursor(
+        &snap, NULL, 3, 20, iov, 8, &bytes
+    ));
+    TEST_ASSERT_EQUAL(expected_size, gather(iov, expected_count, out));
+    TEST_ASSERT_EQUAL_MEMORY(expected, out, expected_size);
+}
@@ -0,0 +1,157 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+ * Add an entry the way the driver does, evicting whatever the retention policy requires first.
+ *
+ * @return  The number of entries evicted.
+ */
+static size_t add_with_policy(
+    struct aesd_circular_buffer *buffer, const char *data, size_t size, uint64_t now
+) {
+    struct aesd_buffer_entry entry = {.buffptr = data, .size = size, .stamp = now};
+    struct aesd_buffer_entry evicted;
+    size_t evicted_count = 0;
+    while (aesd_circular_buffer_evict_entry(buffer, &entry, now, &evicted)) {
+        evicted_count++;
+    }
+    TEST_ASSERT_NULL_MESSAGE(
+        aesd_circular_buffer_add_entry(buffer, &entry),
+        "nothing should be overwritten after evicting"
+    );
+    return evicted_count;
+}
+
+void test_circular_buffer_retention_depth()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        TEST_ASSERT_EQUAL(0, add_with_policy(&buffer, "a\n", 2, 0));
+    }
+    TEST_ASSERT_EQUAL(1, add_with_policy(&buffer, "b\n", 2, 0));
+    TEST_ASSERT_EQUAL(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, aesd_circular_buffer_count(&buffer));
+}
+
+void test_circular_buffer_retention_max_bytes()
+{
+    static char data[100];
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    buffer.max_bytes = 100;
+
+    // Small entries fill the byte budget before the depth
+    for (int i = 0; i < 5; i++) {
+        TEST_ASSERT_EQUAL(0, add_with_policy(&buffer, data, 20, 0));
+    }
+    TEST_ASSERT_EQUAL(100, aesd_circular_buffer_size(&buffer));
+
+    // A large entry evicts as many old entries as needed in one insert
+    TEST_ASSERT_EQUAL(3, add_with_policy(&buffer, data, 50, 0));
+    TEST_ASSERT_EQUAL(3, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL(90, aesd_circular_buffer_size(&buffer));
+
+    // An entry over the budget on its own is still retained as the most recent entry
+    TEST_ASSERT_EQUAL(3, add_with_policy(&buffer, data, 150, 0));
+    TEST_ASSERT_EQUAL(1, aesd_circular_buffer_count(&buffer));
+
+    // Trimming without an incoming entry keeps the most recent entry
+    struct aesd_buffer_entry evicted;
+    TEST_ASSERT_FALSE(aesd_circular_buffer_evict_entry(&buffer, NULL, 0, &evicted));
+}
+
+void test_circular_buffer_retention_max_age()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    buffer.max_age = 10;
+
+    add_with_policy(&buffer, "a\n", 2, 0);
+    add_with_policy(&buffer, "b\n", 2, 5);
+    add_with_policy(&buffer, "c\n", 2, 10);
+    TEST_ASSERT_EQUAL(3, aesd_circular_buffer_count(&buffer));
+
+    // Entries more than max_age older than the incoming one are dropped
+    TEST_ASSERT_EQUAL(2, add_with_policy(&buffer, "d\n", 2, 16));
+    struct aesd_buffer_entry *oldest = aesd_circular_buffer_get_entry_at_out_index(&buffer, 0);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("c\n", oldest->buffptr, "oldest entry should be c");
+
+    // Expired entries are trimmed without an incoming entry too
+    struct aesd_buffer_entry evicted;
+    size_t evicted_count = 0;
+    while (aesd_circular_buffer_evict_entry(&buffer, NULL, 100, &evicted)) {
+        evicted_count++;
+    }
+    TEST_ASSERT_EQUAL(2, evicted_count);
+    TEST_ASSERT_EQUAL(0, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL(0, aesd_circular_buffer_size(&buffer));
+}
+
+void test_circular_buffer_retention_combined()
+{
+    static char data[64];
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    buffer.max_bytes = 64;
+    buffer.max_age = 100;
+
+    // Whichever limit is hit first decides what gets evicted
+    for (int i = 0; i < 20; i++) {
+        add_with_policy(&buffer, data, 4, (uint64_t)i);
+    }
+    TEST_ASSERT_EQUAL(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, aesd_circular_buffer_count(&buffer));
+    add_with_policy(&buffer, data, 40, 20);
+    TEST_ASSERT_EQUAL(7, aesd_circular_buffer_count(&buffer));
+    add_with_policy(&buffer, data, 4, 200);
+    TEST_ASSERT_EQUAL(1, aesd_circular_buffer_count(&buffer));
+}
+
+void test_circular_buffer_retention_expiry()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    uint64_t expiry = 0;
+    TEST_ASSERT_FALSE(aesd_circular_buffer_expiry(&buffer, &expiry));
+    add_with_policy(&buffer, "a\n", 2, 0);
+    TEST_ASSERT_FALSE_MESSAGE(
+        aesd_circular_buffer_expiry(&buffer, &expiry), "nothing expires without a max_age"
+    );
+
+    buffer.max_age = 10;
+    add_with_policy(&buffer, "b\n", 2, 5);
+    add_with_policy(&buffer, "c\n", 2, 8);
+    TEST_ASSERT_TRUE(aesd_circular_buffer_expiry(&buffer, &expiry));
+    TEST_ASSERT_EQUAL(11, expiry);
+
+    // Nothing is dropped before the expiry, even with no new entries
+    struct aesd_buffer_entry evicted;
+    TEST_ASSERT_FALSE(aesd_circular_buffer_evict_entry(&buffer, NULL, expiry - 1, &evicted));
+
+    // Trimming at each expiry in turn, the way the driver does while idle, empties the buffer
+    const char *expected[] = {"a\n", "b\n", "c\n"};
+    uint64_t expected_expiry[] = {11, 16, 19};
+    for (size_t i = 0; i < 3; i++) {
+        TEST_ASSERT_TRUE(aesd_circular_buffer_expiry(&buffer, &expiry));
+        TEST_ASSERT_EQUAL(expected_expiry[i], expiry);
+        TEST_ASSERT_TRUE(aesd_circular_buffer_evict_entry(&buffer, NULL, expiry, &evicted));
+        TEST_ASSERT_EQUAL_STRING(expected[i], evicted.buffptr);
+        TEST_ASSERT_FALSE(aesd_circular_buffer_evict_entry(&buffer, NULL, expiry, &evicted));
+
+        // A reader after the expiry only finds the entries that haven't expired
+        size_t entry_offset = 0;
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+            &buffer, 0, &entry_offset
+        );
+        if (i < 2) {
+            TEST_ASSERT_NOT_NULL(entry);
+            TEST_ASSERT_EQUAL_STRING(expected[i + 1], entry->buffptr);
+        } else {
+            TEST_ASSERT_NULL(entry);
+        }
+    }
+    TEST_ASSERT_EQUAL(0, aesd_circular_buffer_size(&buffer));
+    TEST_ASSERT_FALSE(aesd_circular_buffer_expiry(&buffer, &expiry));
+}
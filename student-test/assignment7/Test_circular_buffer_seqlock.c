@@ -0,0 +1,158 @@
+#include "unity.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer-seqlock.h"
+
+/** Every record is "%08u\n", so a snapshot is a run of consecutively numbered 9 byte records */
+#define RECORD_SIZE 9
+#define STRESS_RECORDS 200000U
+#define STRESS_READERS 4
+#define STRESS_DEPTH 64
+#define STRESS_ARENA 512
+
+struct stress_state
+{
+    struct aesd_seqlock_buffer sb;
+    atomic_bool done;
+    atomic_uint bad_snapshots;
+    atomic_uint snapshots;
+};
+
+static void format_record(char *record, unsigned n)
+{
+    char tmp[RECORD_SIZE + 1];
+    snprintf(tmp, sizeof(tmp), "%08u\n", n);
+    memcpy(record, tmp, RECORD_SIZE);
+}
+
+/**
+ * @return  true if @param data holds whole, consecutively numbered records.
+ */
+static bool check_snapshot(const char *data, size_t size)
+{
+    if (size % RECORD_SIZE != 0) {
+        return false;
+    }
+    unsigned first = 0;
+    for (size_t offs = 0; offs < size; offs += RECORD_SIZE) {
+        char expected[RECORD_SIZE];
+        unsigned n = 0;
+        if (sscanf(data + offs, "%8u", &n) != 1) {
+            return false;
+        }
+        if (offs == 0) {
+            first = n;
+        }
+        format_record(expected, first + (unsigned)(offs / RECORD_SIZE));
+        if (memcmp(expected, data + offs, RECORD_SIZE) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *stress_producer(void *arg)
+{
+    struct stress_state *state = arg;
+    char record[RECORD_SIZE];
+    for (unsigned n = 0; n < STRESS_RECORDS; n++) {
+        format_record(record, n);
+        aesd_seqlock_buffer_append(&state->sb, record, RECORD_SIZE);
+    }
+    atomic_store(&state->done, true);
+    return NULL;
+}
+
+static void *stress_reader(void *arg)
+{
+    struct stress_state *state = arg;
+    char snapshot[STRESS_ARENA + 1];
+    char record[RECORD_SIZE + 1];
+    unsigned i = 0;
+    while (!atomic_load(&state->done)) {
+        // Alternate between whole-history snapshots and single entries
+        if (i++ % 2 == 0) {
+            size_t size = aesd_seqlock_buffer_read(&state->sb, 0, snapshot, sizeof(snapshot));
+            if (!check_snapshot(snapshot, size)) {
+                atomic_fetch_add(&state->bad_snapshots, 1);
+            }
+        } else {
+            size_t size = 0;
+            if (
+                aesd_seqlock_buffer_read_entry(&state->sb, i % 8, record, sizeof(record), &size)
+                && (size != RECORD_SIZE || !check_snapshot(record, size))
+            ) {
+                atomic_fetch_add(&state->bad_snapshots, 1);
+            }
+        }
+        atomic_fetch_add(&state->snapshots, 1);
+    }
+    return NULL;
+}
+
+void test_circular_buffer_seqlock_single_thread()
+{
+    struct aesd_seqlock_buffer sb;
+    TEST_ASSERT_EQUAL(0, aesd_seqlock_buffer_init(&sb, 4, 16));
+
+    char out[32];
+    TEST_ASSERT_EQUAL(0, aesd_seqlock_buffer_read(&sb, 0, out, sizeof(out)));
+    TEST_ASSERT_TRUE(aesd_seqlock_buffer_append(&sb, "abc\n", 4));
+    TEST_ASSERT_TRUE(aesd_seqlock_buffer_append(&sb, "defgh\n", 6));
+    TEST_ASSERT_EQUAL(10, aesd_seqlock_buffer_size(&sb));
+    TEST_ASSERT_EQUAL(10, aesd_seqlock_buffer_read(&sb, 0, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_MEMORY("abc\ndefgh\n", out, 10);
+
+    // Entries wrap around the end of the arena and evict the oldest entry to make room
+    TEST_ASSERT_TRUE(aesd_seqlock_buffer_append(&sb, "ijklmnop\n", 9));
+    TEST_ASSERT_EQUAL(15, aesd_seqlock_buffer_read(&sb, 0, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_MEMORY("defgh\nijklmnop\n", out, 15);
+    TEST_ASSERT_EQUAL(4, aesd_seqlock_buffer_read(&sb, 11, out, sizeof(out)));
+    TEST_ASSERT_EQUAL_MEMORY("nop\n", out, 4);
+
+    size_t size = 0;
+    TEST_ASSERT_TRUE(aesd_seqlock_buffer_read_entry(&sb, 1, out, sizeof(out), &size));
+    TEST_ASSERT_EQUAL(9, size);
+    TEST_ASSERT_EQUAL_MEMORY("ijklmnop\n", out, 9);
+    TEST_ASSERT_FALSE(aesd_seqlock_buffer_read_entry(&sb, 2, out, sizeof(out), &size));
+
+    // Entries larger than the arena are rejected
+    TEST_ASSERT_FALSE(aesd_seqlock_buffer_append(&sb, "0123456789abcdefg", 17));
+    aesd_seqlock_buffer_destroy(&sb);
+}
+
+void test_circular_buffer_seqlock_stress()
+{
+    static struct stress_state state;
+    TEST_ASSERT_EQUAL(0, aesd_seqlock_buffer_init(&state.sb, STRESS_DEPTH, STRESS_ARENA));
+    atomic_init(&state.done, false);
+    atomic_init(&state.bad_snapshots, 0);
+    atomic_init(&state.snapshots, 0);
+
+    pthread_t readers[STRESS_READERS];
+    pthread_t producer;
+    for (int i = 0; i < STRESS_READERS; i++) {
+        TEST_ASSERT_EQUAL(0, pthread_create(&readers[i], NULL, stress_reader, &state));
+    }
+    TEST_ASSERT_EQUAL(0, pthread_create(&producer, NULL, stress_producer, &state));
+    pthread_join(producer, NULL);
+    for (int i = 0; i < STRESS_READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    TEST_ASSERT_EQUAL_MESSAGE(0, atomic_load(&state.bad_snapshots), "torn snapshot observed");
+    TEST_ASSERT_TRUE_MESSAGE(atomic_load(&state.snapshots) > 0, "readers made no progress");
+
+    // The producer finished, so the history ends with the last records written
+    char snapshot[STRESS_ARENA];
+    size_t size = aesd_seqlock_buffer_read(&state.sb, 0, snapshot, sizeof(snapshot));
+    TEST_ASSERT_TRUE(check_snapshot(snapshot, size));
+    char last[RECORD_SIZE];
+    format_record(last, STRESS_RECORDS - 1);
+    TEST_ASSERT_EQUAL_MEMORY(last, snapshot + size - RECORD_SIZE, RECORD_SIZE);
+    aesd_seqlock_buffer_destroy(&state.sb);
+}